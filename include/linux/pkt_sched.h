@@ -645,11 +645,37 @@ enum {
 	TCA_QFQ_UNSPEC,
 	TCA_QFQ_WEIGHT,
 	TCA_QFQ_LMAX,
+	TCA_QFQ_BATCH,	/* Array of struct tc_qfq_class_spec */
+	TCA_QFQ_ECN_THRESH,	/* Mark CE above this many queued packets */
+	TCA_QFQ_ECN_TARGET,	/* Mark CE above this sojourn time in us. Only
+				 * for lightweight classes and those with a
+				 * pfifo or bfifo child qdisc.
+				 */
+	TCA_QFQ_PRIO_RATE,	/* Serve the class before all others, at up to
+				 * this many Mbps. Only at class creation.
+				 */
+	TCA_QFQ_PRIO_BURST,	/* Token bucket size of the priority class */
+	TCA_QFQ_CEIL,	/* Rate in Mbps the class may reach with link time
+			 * other classes leave unused, 0 for its weight.
+			 * ceil - weight summed over the classes is bounded
+			 * like the sum of the weights.
+			 */
 	__TCA_QFQ_MAX
 };
 
 #define TCA_QFQ_MAX	(__TCA_QFQ_MAX - 1)
 
+/* Entry of a TCA_QFQ_BATCH attribute, used to create or change many classes
+ * with a single request. An lmax of 0 selects the default maximum packet
+ * size. A netlink attribute is at most 64KB long, so a single request can
+ * carry about 5000 entries.
+ */
+struct tc_qfq_class_spec {
+	__u32 classid;
+	__u32 weight;
+	__u32 lmax;
+};
+
 enum {
 	TCA_QFQ_XSTATS_UNSPEC,
 	TCA_QFQ_XSTATS_QDISC,
@@ -669,12 +695,41 @@ struct tc_qfq_qd_stats {
 			    * dequeue operation
 			    */
 	__u64 update_grp_on_deq; /* Group required update after dequeueing */
-	__u64 txq_blocked; /* Interface frozen or stopped while trying to
-			    * transmit skb. For each skb dequeued from qdisc,
-			    * we increment this value at most once (not for
-			    * each time we retry).
+	__u64 txq_blocked; /* Number of times a transmit queue stalled with
+			    * a packet for it at the head of an eligible
+			    * class or refused by the driver. A stall ends
+			    * with the next transmit on that queue.
 			    */
 	__u32 wsum_active; /* Sum of weights of currently active classes */
+	/* Drops by reason, these add up to the qdisc drop count */
+	__u64 drop_classify; /* No class for the packet */
+	__u64 drop_limit; /* Class queue full */
+	__u64 drop_activate; /* Class could not be activated */
+	__u64 drop_budget; /* Over the qdisc memory budget */
+	__u64 drop_parent; /* Dropped on request of a parent qdisc */
+	/* Spinner */
+	__u64 activations; /* Work entries processed */
+	__u64 activation_passes; /* Passes over the work queues that found work */
+	__u64 spin_busy; /* Loop iterations that dequeued a packet */
+	__u64 spin_idle; /* Loop iterations that did not */
+	__u64 v_diff_sum; /* V increment still owed for sent packets */
+	__u64 t_diff_sum; /* Transmission time in ns of those packets; how far
+			   * V lags behind the packets already sent
+			   */
+	__u32 work_depth_max; /* Most work entries queued at the start of a
+			       * pass
+			       */
+	__u64 lag_max; /* Largest lag_max of any class */
+	__u64 work_deferred; /* Passes that left work entries for the next */
+	__u64 credit_capped; /* Updates of V cut short by idle_credit_us */
+	__u64 credit_dropped; /* Real time in ns not credited to V by them */
+	__u64 prio_packets; /* Packets sent from the priority class */
+	__u64 prio_throttled; /* Times its head packet waited for tokens */
+	__u64 excess_packets; /* Packets sent above the weight of their class */
+	__u32 excess_wsum_active; /* Sum of ceil - weight of classes active
+				   * above their weight
+				   */
+	__u32 work_pass_max; /* Most work entries processed in one pass */
 };
 
 struct tc_qfq_cl_stats {
@@ -688,6 +743,12 @@ struct tc_qfq_cl_stats {
 					       * difference computed
 					       * from 1482 sized
 					       * packets */
+	__u64 ecn_mark; /* Packets marked CE by the ECN thresholds */
+	__s64 lag; /* Bytes served since the class became backlogged minus
+		    * bytes due at its rate over that time, 0 when idle
+		    */
+	__u64 lag_max; /* Largest shortfall (-lag) seen at a dequeue */
+	__u64 excess_packets; /* Packets sent above the weight of the class */
 };
 
 struct tc_qfq_xstats {
@@ -698,6 +759,60 @@ struct tc_qfq_xstats {
 	};
 };
 
+/* Layout of the read-only stats_map file a QFQ qdisc exports in debugfs when
+ * the stats_map_entries module parameter is set. The header is followed by
+ * nr_entries entries of entry_size bytes. An entry is being updated while its
+ * seq is odd; readers retry when seq is odd or changed across the read.
+ */
+#define TC_QFQ_MAP_VERSION	1
+
+struct tc_qfq_map_hdr {
+	__u32 version;
+	__u32 entry_size;
+	__u32 nr_entries;
+	__u32 reserved[13];	/* Pads the header to 64 bytes */
+};
+
+struct tc_qfq_map_entry {
+	__u32 seq;
+	__u32 classid;		/* 0 if the entry is unused */
+	__u64 bytes;		/* Enqueued bytes */
+	__u32 packets;		/* Enqueued packets */
+	__u32 drops;
+	__u32 backlog;		/* Bytes queued */
+	__u32 qlen;		/* Packets queued */
+	__u64 bps;		/* Rate estimate in bytes/s */
+	__u64 pps;		/* Rate estimate in packets/s */
+	__u64 est_time;		/* Time of the estimate in ns of the qdisc
+				 * clock; an idle class is not re-estimated
+				 */
+	__u64 reserved;
+};
+
+/* Record of a packet dequeued by a QFQ qdisc, written to the relay files
+ * log<cpu> of the qdisc's debugfs directory when the log_subbufs module
+ * parameter is set. V, S and F are virtual times with TC_QFQ_FRAC_BITS
+ * fractional bits; a class of weight w is served at w Mbps, so one unit of
+ * virtual time is 8000 >> TC_QFQ_FRAC_BITS ns of its service. A packet sent
+ * above the weight of its class has TC_QFQ_LOG_EXCESS set in group, and its
+ * times and inv_w are those of the excess tier, scheduled at ceil - weight.
+ * The last packet of a class before it went idle has TC_QFQ_LOG_LAST set.
+ */
+#define TC_QFQ_FRAC_BITS	30
+#define TC_QFQ_LOG_EXCESS	0x80000000
+#define TC_QFQ_LOG_LAST		0x40000000
+
+struct tc_qfq_log_rec {
+	__u64 time;		/* ns of the qdisc clock */
+	__u64 V;		/* System virtual time */
+	__u64 S;		/* Virtual start time of the packet */
+	__u64 F;		/* Virtual finish time of the packet */
+	__u32 classid;
+	__u32 len;		/* Bytes charged, including overhead */
+	__u32 inv_w;		/* (1 << TC_QFQ_FRAC_BITS) / weight */
+	__u32 group;
+};
+
 /* CODEL */
 
 enum {
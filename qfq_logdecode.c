@@ -0,0 +1,204 @@
+/*
+ * qfq_logdecode: summarize the packet log of a QFQ-RL qdisc.
+ *
+ * Reads struct tc_qfq_log_rec records from the relay files log<cpu> in the
+ * debugfs directory of the qdisc (or from stdin) and prints, for each class,
+ * the service it got and its lag against its rate in real time, in bytes,
+ * as the kernel reports it in tc_qfq_cl_stats.lag: the bytes served since
+ * the class became backlogged minus the bytes its weight entitled it to in
+ * that time, sampled right before each packet. A negative lag means the
+ * class was behind its rate. Packets a class sent above its weight, up to
+ * its ceiling, count as served. The log does not record when a class was
+ * activated, so its lag is counted from the first packet of each backlogged
+ * period; a change of weight starts a new period, as in the kernel.
+ *
+ * Usage: qfq_logdecode [log file ...]
+ *
+ * Copy the log out first, e.g.
+ *	cat /sys/kernel/debug/qfq/eth4-1/log2 > qfq.log
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include "include/linux/pkt_sched.h"
+
+/* Bytes due at weight (1 << TC_QFQ_FRAC_BITS) / inv_w Mbps over ns */
+#define LAG_DUE(ns, inv_w) \
+	((double)(ns) * (1ULL << TC_QFQ_FRAC_BITS) / ((double)(inv_w) * 8000))
+
+struct class_lag {
+	uint32_t classid;
+	uint32_t inv_w;			/* Of the weight, 0 until known */
+	uint64_t packets;
+	uint64_t excess;		/* Packets sent above the weight */
+	uint64_t bytes;
+	uint64_t first, last;		/* Times of the first and last packet */
+	int busy;			/* In a backlogged period */
+	uint64_t start;			/* First packet of the period */
+	uint64_t served;		/* Bytes since then */
+	uint64_t samples;
+	double lag_sum;			/* bytes */
+	double lag_min, lag_max;
+};
+
+static struct class_lag *classes;
+static size_t nr_classes, table_size;
+
+/* Open addressing on classid, grown at half load */
+static struct class_lag *class_find(uint32_t classid)
+{
+	struct class_lag *old = classes;
+	size_t old_size = table_size;
+	size_t i;
+
+	if (2 * (nr_classes + 1) > table_size) {
+		table_size = table_size ? 2 * table_size : 1024;
+		classes = calloc(table_size, sizeof(*classes));
+		if (classes == NULL) {
+			perror("calloc");
+			exit(1);
+		}
+		nr_classes = 0;
+		for (i = 0; i < old_size; i++) {
+			if (old[i].classid)
+				*class_find(old[i].classid) = old[i];
+		}
+		free(old);
+	}
+
+	i = (classid * 2654435761U) & (table_size - 1);
+	while (classes[i].classid && classes[i].classid != classid)
+		i = (i + 1) & (table_size - 1);
+
+	if (!classes[i].classid) {
+		classes[i].classid = classid;
+		nr_classes++;
+	}
+	return &classes[i];
+}
+
+static void account(const struct tc_qfq_log_rec *rec)
+{
+	struct class_lag *c = class_find(rec->classid);
+	double lag;
+
+	if (!c->packets)
+		c->first = rec->time;
+	c->packets++;
+	c->bytes += rec->len;
+	c->last = rec->time;
+
+	/* inv_w of the excess tier is not the class's weight */
+	if (rec->group & TC_QFQ_LOG_EXCESS) {
+		c->excess++;
+	} else if (rec->inv_w != c->inv_w) {
+		c->inv_w = rec->inv_w;
+		c->busy = 0;
+	}
+
+	if (!c->busy) {
+		c->busy = 1;
+		c->start = rec->time;
+		c->served = 0;
+	}
+
+	if (c->inv_w) {
+		lag = (double)c->served - LAG_DUE(rec->time - c->start,
+						  c->inv_w);
+		if (!c->samples++) {
+			c->lag_min = lag;
+			c->lag_max = lag;
+		}
+		c->lag_sum += lag;
+		if (lag < c->lag_min)
+			c->lag_min = lag;
+		if (lag > c->lag_max)
+			c->lag_max = lag;
+	}
+
+	c->served += rec->len;
+	if (rec->group & TC_QFQ_LOG_LAST)
+		c->busy = 0;
+}
+
+static int decode(FILE *f, const char *name)
+{
+	struct tc_qfq_log_rec rec;
+
+	while (fread(&rec, sizeof(rec), 1, f) == 1) {
+		/* Unused tail of a sub-buffer */
+		if (!rec.classid)
+			continue;
+		account(&rec);
+	}
+
+	if (ferror(f)) {
+		fprintf(stderr, "%s: %s\n", name, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+static int cmp_classid(const void *a, const void *b)
+{
+	const struct class_lag *x = a, *y = b;
+
+	return x->classid < y->classid ? -1 : x->classid > y->classid;
+}
+
+static void report(void)
+{
+	struct class_lag *c;
+	double mbps, weight, lag_avg;
+	size_t i;
+
+	qsort(classes, table_size, sizeof(*classes), cmp_classid);
+
+	printf("# class weight packets excess bytes mbps lag_min lag_avg lag_max\n");
+	for (i = 0; i < table_size; i++) {
+		c = &classes[i];
+		if (!c->classid)
+			continue;
+
+		weight = c->inv_w ?
+			 (double)(1ULL << TC_QFQ_FRAC_BITS) / c->inv_w : 0;
+		mbps = c->last > c->first ?
+		       (double)c->bytes * 8000 / (c->last - c->first) : 0;
+		lag_avg = c->samples ? c->lag_sum / c->samples : 0;
+		printf("%x:%x %.0f %llu %llu %llu %.1f %.0f %.0f %.0f\n",
+		       c->classid >> 16, c->classid & 0xffff, weight,
+		       (unsigned long long)c->packets,
+		       (unsigned long long)c->excess,
+		       (unsigned long long)c->bytes, mbps,
+		       c->lag_min, lag_avg, c->lag_max);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	FILE *f;
+	int i, err = 0;
+
+	if (argc < 2) {
+		err = decode(stdin, "stdin");
+	} else {
+		for (i = 1; i < argc; i++) {
+			f = fopen(argv[i], "rb");
+			if (f == NULL) {
+				fprintf(stderr, "%s: %s\n", argv[i],
+					strerror(errno));
+				return 1;
+			}
+			if (decode(f, argv[i]))
+				err = -1;
+			fclose(f);
+		}
+	}
+
+	report();
+	return err ? 1 : 0;
+}
@@ -0,0 +1,167 @@
+/*
+ * Virtual time arithmetic of the QFQ-RL scheduler, kept apart from sch_qfq.c
+ * so that qfq_vtime_test can check it in userspace, along with the constants
+ * it depends on. The includer provides the kernel types and helpers used
+ * here.
+ */
+#ifndef _QFQ_VTIME_H
+#define _QFQ_VTIME_H
+
+/*
+ * Maximum number of consecutive slots occupied by backlogged classes
+ * inside a group.
+ */
+#define QFQ_MAX_SLOTS	32
+
+/*
+ * Shifts used for class<->group mapping.  We allow class weights that are
+ * in the range [1, 2^MAX_WSHIFT], and we try to map each class i to the
+ * group with the smallest index that can support the L_i / r_i configured
+ * for the class.
+ *
+ * grp->index is the index of the group; and grp->slot_shift
+ * is the shift for the corresponding (scaled) sigma_i.
+ */
+#define QFQ_MAX_INDEX		19
+#define QFQ_MAX_WSHIFT		16
+
+#define	QFQ_MAX_WEIGHT		(1<<QFQ_MAX_WSHIFT)
+#define QFQ_MAX_WSUM		(2*QFQ_MAX_WEIGHT)
+
+#define FRAC_BITS		30	/* fixed point arithmetic */
+#define ONE_FP			(1UL << FRAC_BITS)
+#define IWSUM			(ONE_FP/QFQ_MAX_WSUM)
+
+#define QFQ_MTU_SHIFT		11
+#define QFQ_MIN_SLOT_SHIFT	(FRAC_BITS + QFQ_MTU_SHIFT - QFQ_MAX_INDEX)
+
+/*
+ * Largest step of V over an idle period. Every group starts within
+ * QFQ_MAX_SLOTS << (QFQ_MTU_SHIFT + FRAC_BITS) of V, so a step of twice that
+ * makes every backlogged group eligible and longer idle periods are clamped
+ * to it. How much real time that is depends on the drain rate: at full rate
+ * V covers the span in about half a second, and it takes longer when
+ * wsum_active is above the link speed. The clamp is therefore on V rather
+ * than on time. It also keeps the step far below 2^63, which the signed
+ * comparisons in qfq_gt() rely on.
+ */
+#define QFQ_MAX_IDLE_V	(2ULL * QFQ_MAX_SLOTS << (QFQ_MTU_SHIFT + FRAC_BITS))
+
+/*
+ * Longest idle period the step is computed for. V advances by at most
+ * ONE_FP / 8000 < 2^18 per ns, so the quotient below stays within 64 bits;
+ * at that rate V reaches QFQ_MAX_IDLE_V long before.
+ */
+#define QFQ_MAX_IDLE_NS	(1ULL << 45)
+
+/*
+ * a * b / c with the larger factor shifted down until the product fits in
+ * 64 bits, losing only low-order bits of the result.
+ */
+static inline u64 __qfq_mul_div(u64 a, u64 b, u64 c)
+{
+	int excess = fls64(a) + fls64(b) - 64;
+
+	if (excess <= 0)
+		return div64_u64(a * b, c);
+	if (a > b)
+		a >>= excess;
+	else
+		b >>= excess;
+	return div64_u64(a * b, c) << excess;
+}
+
+/*
+ * a * b / c with a 128-bit intermediate product. The drain rate at 100Gbps
+ * is about 2^34, so a plain u64 product overflows after one second of idle.
+ * Without 128-bit arithmetic __qfq_mul_div() approximates it.
+ */
+static inline u64 qfq_mul_div(u64 a, u64 b, u64 c)
+{
+#if BITS_PER_LONG == 64 && defined(__SIZEOF_INT128__)
+	return (u64)(((unsigned __int128)a * b) / c);
+#else
+	return __qfq_mul_div(a, b, c);
+#endif
+}
+
+/*
+ * Advance of V over t_diff ns of idle link: drain_rate is the link speed in
+ * bytes/ns scaled by ONE_FP, and div the larger of the link speed and the
+ * active weight sum, both in Mbps.
+ */
+static inline u64 qfq_idle_v(u64 drain_rate, u64 t_diff, u32 div)
+{
+	u64 v_diff = qfq_mul_div(drain_rate,
+				 min_t(u64, t_diff, QFQ_MAX_IDLE_NS), div);
+
+	return min_t(u64, v_diff, QFQ_MAX_IDLE_V);
+}
+
+/*
+ * A gap between updates with classes backlogged (the spinner was held off,
+ * or only ineligible groups were left) would make all of them eligible at
+ * once and release the time they missed as a burst. So with wsum_active set,
+ * t_diff is cut down to credit ns unless credit is 0, and the time beyond is
+ * forfeited. Catch-up still owed for sent packets is not lost; it is spread
+ * over the following updates. Returns the ns not credited.
+ */
+static inline u64 qfq_v_credit(u64 *t_diff, u64 credit, u32 wsum_active)
+{
+	u64 dropped;
+
+	if (!credit || !wsum_active || *t_diff <= credit)
+		return 0;
+
+	dropped = *t_diff - credit;
+	*t_diff = credit;
+	return dropped;
+}
+
+/*
+ * Advance of V over t_diff ns, which only the caller adds to V. The catch-up
+ * still owed for packets sent earlier, v_diff_sum over the t_diff_sum ns
+ * they took to transmit, is paid first and in proportion to the time that
+ * passed. Time left over after that advances V at the drain rate, but only
+ * if idle tells that no group is eligible and ready.
+ */
+static inline u64 qfq_v_advance(u64 *v_diff_sum, u64 *t_diff_sum, u64 t_diff,
+				int idle, u64 drain_rate, u32 div)
+{
+	u64 v_diff = 0;
+
+	if (*t_diff_sum) {
+		if (t_diff < *t_diff_sum) {
+			v_diff = qfq_mul_div(*v_diff_sum, t_diff, *t_diff_sum);
+			*v_diff_sum -= v_diff;
+			*t_diff_sum -= t_diff;
+			return v_diff;
+		}
+
+		v_diff = *v_diff_sum;
+		t_diff -= *t_diff_sum;
+		*v_diff_sum = 0;
+		*t_diff_sum = 0;
+	}
+
+	if (idle)
+		v_diff += qfq_idle_v(drain_rate, t_diff, div);
+	return v_diff;
+}
+
+/*
+ * Advance v_diff of V cut short at limit, though never below V. The excess
+ * tier passes the finish time of its first eligible group: its V runs in
+ * real time, and must not run away from classes the guaranteed tier keeps
+ * from being served, or they would later catch up above their ceiling.
+ */
+static inline u64 qfq_v_bound(u64 V, u64 v_diff, u64 limit)
+{
+	s64 room = (s64)(limit - V);
+
+	if (room <= 0)
+		return 0;
+	return min_t(u64, v_diff, room);
+}
+
+#endif /* _QFQ_VTIME_H */
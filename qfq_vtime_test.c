@@ -0,0 +1,450 @@
+/*
+ * qfq_vtime_test: check the virtual time arithmetic of the QFQ-RL qdisc.
+ *
+ * Builds qfq_vtime.h, which sch_qfq.c uses for qfq_mul_div() and the update
+ * of V, in userspace and runs it over long idle periods at link speeds up to
+ * 100Gbps and active weight sums up to QFQ_MAX_WSUM, and in a model of the
+ * two tiers serving a class with a ceiling. Prints the failed checks, and
+ * exits with status 1 if there were any.
+ *
+ * Usage: make qfq_vtime_test && ./qfq_vtime_test
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "include/linux/pkt_sched.h"
+
+typedef uint64_t u64;
+typedef int64_t s64;
+typedef uint32_t u32;
+
+#define BITS_PER_LONG		(__SIZEOF_LONG__ * 8)
+#define min_t(t, a, b)		((t)(a) < (t)(b) ? (t)(a) : (t)(b))
+
+static inline int fls64(u64 x)
+{
+	return x ? 64 - __builtin_clzll(x) : 0;
+}
+
+static inline u64 div64_u64(u64 a, u64 b)
+{
+	return a / b;
+}
+
+#include "qfq_vtime.h"
+
+/* Span of start times of the groups around V */
+#define GROUP_SPAN		((u64)QFQ_MAX_SLOTS << (QFQ_MTU_SHIFT + FRAC_BITS))
+
+#define NSEC_PER_SEC		1000000000ULL
+
+static int failures;
+
+#define CHECK(cond, fmt, ...)						\
+	do {								\
+		if (!(cond)) {						\
+			failures++;					\
+			printf("FAIL %s:%d: " fmt "\n", __func__,	\
+			       __LINE__, ##__VA_ARGS__);		\
+		}							\
+	} while (0)
+
+/* As qfq_init_qdisc sets it up */
+static u64 drain_rate(u32 link_speed)
+{
+	return (u64)link_speed * 125 * ONE_FP / 1000000;
+}
+
+static const u32 link_speeds[] = { 1000, 9800, 40000, 100000 };
+
+static const u64 idle_ns[] = {
+	0, 1, 1000, 1000000, NSEC_PER_SEC, 5 * NSEC_PER_SEC,
+	60 * NSEC_PER_SEC, 3600 * NSEC_PER_SEC, 86400 * NSEC_PER_SEC,
+	1ULL << 45, 1ULL << 50, UINT64_MAX,
+};
+
+static void test_mul_div(void)
+{
+	static const u64 a[] = {
+		1, 1500, 1ULL << 32, 1ULL << 34, 1ULL << 50, 1ULL << 62,
+	};
+	static const u64 b[] = {
+		1, 1000, NSEC_PER_SEC, 86400 * NSEC_PER_SEC, 1ULL << 45,
+	};
+	static const u64 c[] = {
+		1, 8000, 100000, QFQ_MAX_WSUM, 1ULL << 40,
+	};
+	unsigned int i, j, k;
+
+	for (i = 0; i < sizeof(a) / sizeof(a[0]); i++)
+	for (j = 0; j < sizeof(b) / sizeof(b[0]); j++)
+	for (k = 0; k < sizeof(c) / sizeof(c[0]); k++) {
+		unsigned __int128 ref = (unsigned __int128)a[i] * b[j] / c[k];
+		u64 small = a[i] < b[j] ? a[i] : b[j];
+		int excess = fls64(a[i]) + fls64(b[j]) - 64;
+		u64 approx, tol;
+
+		if (ref > UINT64_MAX)
+			continue;
+
+		CHECK(qfq_mul_div(a[i], b[j], c[k]) == (u64)ref,
+		      "%llu * %llu / %llu", (unsigned long long)a[i],
+		      (unsigned long long)b[j], (unsigned long long)c[k]);
+
+		/* The fallback keeps 64 - fls64(small) bits of the larger
+		 * factor, and truncates the quotient before shifting it back.
+		 */
+		approx = __qfq_mul_div(a[i], b[j], c[k]);
+		tol = excess > 0 ? ((u64)ref >> (63 - fls64(small))) +
+				   (1ULL << excess) : 0;
+		CHECK(approx <= ref && (u64)ref - approx <= tol,
+		      "fallback %llu * %llu / %llu = %llu, not %llu",
+		      (unsigned long long)a[i], (unsigned long long)b[j],
+		      (unsigned long long)c[k], (unsigned long long)approx,
+		      (unsigned long long)ref);
+	}
+}
+
+/* The step of V over one idle period, at all speeds and weight sums */
+static void test_idle_step(void)
+{
+	unsigned int i, j, k;
+
+	for (i = 0; i < sizeof(link_speeds) / sizeof(link_speeds[0]); i++) {
+		u32 ls = link_speeds[i];
+		u32 wsums[] = { 0, ls / 2, ls, 2 * ls, QFQ_MAX_WSUM };
+		u64 drain = drain_rate(ls);
+
+		for (j = 0; j < sizeof(wsums) / sizeof(wsums[0]); j++) {
+			u32 div = wsums[j] > ls ? wsums[j] : ls;
+			u64 prev = 0;
+
+			for (k = 0; k < sizeof(idle_ns) / sizeof(idle_ns[0]);
+			     k++) {
+				u64 t = idle_ns[k];
+				u64 v = qfq_idle_v(drain, t, div);
+				unsigned __int128 exact;
+
+				exact = (unsigned __int128)drain *
+					min_t(u64, t, QFQ_MAX_IDLE_NS) / div;
+				if (exact > QFQ_MAX_IDLE_V)
+					exact = QFQ_MAX_IDLE_V;
+
+				CHECK(v == (u64)exact,
+				      "%u Mbps wsum %u idle %llu: %llu, not %llu",
+				      ls, wsums[j], (unsigned long long)t,
+				      (unsigned long long)v,
+				      (unsigned long long)exact);
+				CHECK(v >= prev, "%u Mbps wsum %u idle %llu: "
+				      "V went back", ls, wsums[j],
+				      (unsigned long long)t);
+				CHECK(v < (1ULL << 62),
+				      "%u Mbps wsum %u idle %llu: step too large",
+				      ls, wsums[j], (unsigned long long)t);
+				prev = v;
+			}
+
+			/* A day of idle makes every group eligible */
+			CHECK(qfq_idle_v(drain, 86400 * NSEC_PER_SEC, div) >=
+			      GROUP_SPAN, "%u Mbps wsum %u: V short of the "
+			      "groups after a day", ls, wsums[j]);
+		}
+	}
+}
+
+/*
+ * With wsum_active far above the link speed V takes seconds to cover the
+ * groups, and must not be cut off at any fixed time.
+ */
+static void test_idle_slow(void)
+{
+	u64 drain = drain_rate(9800);
+	u64 v = qfq_idle_v(drain, 5 * NSEC_PER_SEC, QFQ_MAX_WSUM);
+	u64 at_1s = qfq_idle_v(drain, NSEC_PER_SEC, QFQ_MAX_WSUM);
+
+	CHECK(at_1s < GROUP_SPAN, "V covers the groups in 1s at 9800/%u",
+	      QFQ_MAX_WSUM);
+	CHECK(v > 4 * at_1s, "5s of idle advance V by %llu, 1s by %llu",
+	      (unsigned long long)v, (unsigned long long)at_1s);
+}
+
+/* Many short updates advance V as far as one long one, up to rounding */
+static void test_idle_split(void)
+{
+	unsigned int i, j;
+
+	for (i = 0; i < sizeof(link_speeds) / sizeof(link_speeds[0]); i++) {
+		u64 drain = drain_rate(link_speeds[i]);
+		u64 sum = 0, v_diff_sum = 0, t_diff_sum = 0, once;
+
+		for (j = 0; j < 1000000; j++)
+			sum += qfq_v_advance(&v_diff_sum, &t_diff_sum, 1000,
+					     1, drain, link_speeds[i]);
+		once = qfq_idle_v(drain, NSEC_PER_SEC, link_speeds[i]);
+
+		CHECK(sum <= once && once - sum <= 1000000,
+		      "%u Mbps: %llu in 1us steps, %llu at once",
+		      link_speeds[i], (unsigned long long)sum,
+		      (unsigned long long)once);
+	}
+}
+
+/*
+ * Catch-up owed for sent packets is paid in full once their transmission
+ * time passed, whatever the steps, and never runs ahead of that time.
+ */
+static void test_catch_up(void)
+{
+	static const u64 owed[][2] = {
+		/* v_diff_sum, t_diff_sum */
+		{ 1500ULL * ONE_FP / 100000, 1500ULL * 8000 / 100000 },
+		{ 64ULL * 1500 * ONE_FP / 9800, 64ULL * 1500 * 8000 / 9800 },
+		{ 1ULL << 60, 1ULL << 40 },
+		{ 1ULL << 20, 86400 * NSEC_PER_SEC },
+	};
+	unsigned int i;
+	u64 seed = 1;
+
+	for (i = 0; i < sizeof(owed) / sizeof(owed[0]); i++) {
+		u64 v_diff_sum = owed[i][0], t_diff_sum = owed[i][1];
+		u64 paid = 0, elapsed = 0, step;
+		unsigned __int128 due;
+
+		while (t_diff_sum) {
+			seed = seed * 6364136223846793005ULL + 1;
+			step = (seed >> 33) % (owed[i][1] / 7 + 2);
+			paid += qfq_v_advance(&v_diff_sum, &t_diff_sum, step,
+					      0, drain_rate(100000), 100000);
+			elapsed += step;
+
+			due = (unsigned __int128)owed[i][0] *
+			      min_t(u64, elapsed, owed[i][1]) / owed[i][1];
+			CHECK(paid <= due + 1, "owed %llu over %llu ns: paid "
+			      "%llu after %llu ns",
+			      (unsigned long long)owed[i][0],
+			      (unsigned long long)owed[i][1],
+			      (unsigned long long)paid,
+			      (unsigned long long)elapsed);
+		}
+
+		CHECK(paid == owed[i][0] && !v_diff_sum,
+		      "owed %llu, paid %llu", (unsigned long long)owed[i][0],
+		      (unsigned long long)paid);
+	}
+}
+
+#define CREDIT_NS	(100 * 1000ULL)	/* idle_credit_us of 100 */
+
+/* A gap while classes are backlogged is cut to the credit */
+static void test_credit_cap(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(idle_ns) / sizeof(idle_ns[0]); i++) {
+		u64 gap = idle_ns[i], t_diff = gap;
+		u64 dropped = qfq_v_credit(&t_diff, CREDIT_NS, 9800);
+
+		CHECK(t_diff == min_t(u64, gap, CREDIT_NS),
+		      "gap %llu credited %llu", (unsigned long long)gap,
+		      (unsigned long long)t_diff);
+		CHECK(dropped == gap - t_diff, "gap %llu dropped %llu",
+		      (unsigned long long)gap, (unsigned long long)dropped);
+	}
+
+	for (i = 0; i < 3; i++) {
+		u64 gap = CREDIT_NS + i - 1, t_diff = gap;
+
+		CHECK(qfq_v_credit(&t_diff, CREDIT_NS, 9800) ==
+		      (i == 2 ? 1 : 0) && t_diff == min_t(u64, gap, CREDIT_NS),
+		      "gap %llu at the credit", (unsigned long long)gap);
+	}
+}
+
+/* Nothing is cut when no class is active, or without a credit */
+static void test_credit_idle(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(idle_ns) / sizeof(idle_ns[0]); i++) {
+		u64 t_diff = idle_ns[i];
+
+		CHECK(!qfq_v_credit(&t_diff, CREDIT_NS, 0) &&
+		      t_diff == idle_ns[i], "gap %llu cut with nothing active",
+		      (unsigned long long)idle_ns[i]);
+		CHECK(!qfq_v_credit(&t_diff, 0, 9800) && t_diff == idle_ns[i],
+		      "gap %llu cut without a credit",
+		      (unsigned long long)idle_ns[i]);
+	}
+}
+
+/*
+ * Catch-up owed for sent packets survives a capped gap: the capped update
+ * pays only for the credited time, and later updates pay the rest.
+ */
+static void test_credit_catch_up(void)
+{
+	static const u64 owed[][2] = {
+		/* v_diff_sum, t_diff_sum */
+		{ 64ULL * 1500 * ONE_FP / 9800, 64ULL * 1500 * 8000 / 9800 },
+		{ 1000ULL * 1500 * ONE_FP / 9800, 1000ULL * 1500 * 8000 / 9800 },
+		{ 1ULL << 40, 5 * CREDIT_NS },
+	};
+	unsigned int i;
+
+	for (i = 0; i < sizeof(owed) / sizeof(owed[0]); i++) {
+		u64 v_diff_sum = owed[i][0], t_diff_sum = owed[i][1];
+		u64 t_diff = NSEC_PER_SEC, paid, dropped, steps = 0;
+		unsigned __int128 due;
+
+		dropped = qfq_v_credit(&t_diff, CREDIT_NS, 9800);
+		paid = qfq_v_advance(&v_diff_sum, &t_diff_sum, t_diff, 0,
+				     drain_rate(9800), 9800);
+		due = (unsigned __int128)owed[i][0] *
+		      min_t(u64, CREDIT_NS, owed[i][1]) / owed[i][1];
+		CHECK(dropped == NSEC_PER_SEC - CREDIT_NS,
+		      "owed %llu: dropped %llu", (unsigned long long)owed[i][0],
+		      (unsigned long long)dropped);
+		CHECK(paid <= due + 1, "owed %llu: paid %llu over the gap",
+		      (unsigned long long)owed[i][0], (unsigned long long)paid);
+
+		while (t_diff_sum && steps++ < 1000000) {
+			t_diff = 10000;
+			qfq_v_credit(&t_diff, CREDIT_NS, 9800);
+			paid += qfq_v_advance(&v_diff_sum, &t_diff_sum, t_diff,
+					      0, drain_rate(9800), 9800);
+		}
+		CHECK(paid == owed[i][0] && !v_diff_sum,
+		      "owed %llu, paid %llu after a capped gap",
+		      (unsigned long long)owed[i][0], (unsigned long long)paid);
+	}
+}
+
+/*
+ * One tier of the model below, holding a single always backlogged class of
+ * weight w. S <= V makes it eligible, as its group is in ER then.
+ */
+struct model_tier {
+	u64 V, v_diff_sum, t_diff_sum;
+	u64 S, F;
+	u32 w;
+};
+
+static int model_eligible(const struct model_tier *t)
+{
+	return (s64)(t->S - t->V) <= 0;
+}
+
+/* V update of qfq_update_system_time() */
+static void model_update(struct model_tier *t, u64 t_diff, u32 link_speed,
+			 int excess)
+{
+	int idle = !model_eligible(t);
+	u32 div = t->w > link_speed ? t->w : link_speed;
+	u64 v_diff;
+
+	v_diff = qfq_v_advance(&t->v_diff_sum, &t->t_diff_sum, t_diff,
+			       idle || excess, drain_rate(link_speed), div);
+	if (excess && !idle)
+		v_diff = qfq_v_bound(t->V, v_diff, t->F);
+	t->V += v_diff;
+}
+
+/* Accounting of qfq_dequeue() for a packet of len bytes from tier t */
+static void model_send(struct model_tier *t, u32 len, u32 link_speed)
+{
+	u32 div = t->w > link_speed ? t->w : link_speed;
+
+	t->v_diff_sum += (u64)len * ONE_FP / div;
+	t->t_diff_sum += (u64)len * 8000 / link_speed;
+	t->S = t->F;
+	t->F = t->S + (u64)len * (ONE_FP / t->w);
+}
+
+/*
+ * Model of the spinner serving a single class of weight w and ceiling ceil,
+ * with 1500 byte packets, for a second on an otherwise idle link. The
+ * guaranteed tier goes first, and the excess tier gets the link when the
+ * guaranteed tier has nothing eligible. Returns the rate in Mbps.
+ */
+static u64 model_ceiling(u32 link_speed, u32 w, u32 ceil)
+{
+	struct model_tier guar = { .w = w }, excess = { .w = ceil - w };
+	u64 now = 0, last = 0, bytes = 0;
+	const u32 len = 1500;
+
+	guar.F = (u64)len * (ONE_FP / guar.w);
+	excess.F = (u64)len * (ONE_FP / excess.w);
+
+	while (now < NSEC_PER_SEC) {
+		model_update(&guar, now - last, link_speed, 0);
+		model_update(&excess, now - last, link_speed, 1);
+		last = now;
+
+		if (model_eligible(&guar))
+			model_send(&guar, len, link_speed);
+		else if (model_eligible(&excess))
+			model_send(&excess, len, link_speed);
+		else {
+			now += 100;
+			continue;
+		}
+		bytes += len;
+		now += (u64)len * 8000 / link_speed;
+	}
+	return bytes * 8000 / now;
+}
+
+/*
+ * A class alone on the link reaches its ceiling: the excess tier is not held
+ * back while the guaranteed tier sends, and does not go beyond it.
+ */
+static void test_excess_ceiling(void)
+{
+	static const u32 cases[][3] = {
+		/* link_speed, weight, ceil */
+		{ 9800, 1000, 9800 },
+		{ 9800, 1000, 5000 },
+		{ 9800, 100, 9800 },
+		{ 9800, 4900, 9800 },
+		{ 40000, 1000, 40000 },
+		{ 100000, 10000, 30000 },
+	};
+	unsigned int i;
+
+	for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		u64 rate = model_ceiling(cases[i][0], cases[i][1],
+					 cases[i][2]);
+
+		CHECK(rate * 100 >= (u64)cases[i][2] * 99 &&
+		      rate * 1000 <= (u64)cases[i][2] * 1001,
+		      "%u Mbps weight %u ceil %u: %llu Mbps", cases[i][0],
+		      cases[i][1], cases[i][2], (unsigned long long)rate);
+	}
+}
+
+int main(void)
+{
+	if (FRAC_BITS != TC_QFQ_FRAC_BITS) {
+		printf("FRAC_BITS does not match TC_QFQ_FRAC_BITS\n");
+		return 1;
+	}
+
+	test_mul_div();
+	test_idle_step();
+	test_idle_slow();
+	test_idle_split();
+	test_catch_up();
+	test_credit_cap();
+	test_credit_idle();
+	test_credit_catch_up();
+	test_excess_ceiling();
+
+	if (failures) {
+		printf("%d checks failed\n", failures);
+		return 1;
+	}
+	printf("all checks passed\n");
+	return 0;
+}
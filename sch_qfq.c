@@ -20,9 +20,22 @@
 #include <trace/events/net.h>
 
 #include <linux/kernel.h>
+#include <linux/sched.h>
 #include <linux/sched/rt.h>
 #include <linux/kthread.h>
+#include <linux/rcupdate.h>
+#include <linux/vmalloc.h>
+#include <linux/sort.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/static_key.h>
+#include <linux/timex.h>
+#include <linux/mutex.h>
+#include <linux/rwsem.h>
+#include <linux/completion.h>
+#include <linux/relay.h>
 #include <net/sock.h>
+#include <net/inet_ecn.h>
 
 /*  Quick Fair Queueing
     ===================
@@ -74,38 +87,15 @@
 
  */
 
-/*
- * Maximum number of consecutive slots occupied by backlogged classes
- * inside a group.
- */
-#define QFQ_MAX_SLOTS	32
-
-/*
- * Shifts used for class<->group mapping.  We allow class weights that are
- * in the range [1, 2^MAX_WSHIFT], and we try to map each class i to the
- * group with the smallest index that can support the L_i / r_i configured
- * for the class.
- *
- * grp->index is the index of the group; and grp->slot_shift
- * is the shift for the corresponding (scaled) sigma_i.
- */
-#define QFQ_MAX_INDEX		19
-#define QFQ_MAX_WSHIFT		16
-
-#define	QFQ_MAX_WEIGHT		(1<<QFQ_MAX_WSHIFT)
-#define QFQ_MAX_WSUM		(2*QFQ_MAX_WEIGHT)
-
-#define FRAC_BITS		30	/* fixed point arithmetic */
-#define ONE_FP			(1UL << FRAC_BITS)
-#define IWSUM			(ONE_FP/QFQ_MAX_WSUM)
+/* The constants of this layout, shared with qfq_vtime_test */
+#include "qfq_vtime.h"
 
-#define QFQ_MTU_SHIFT		11
-#define QFQ_MIN_SLOT_SHIFT	(FRAC_BITS + QFQ_MTU_SHIFT - QFQ_MAX_INDEX)
+#define QFQ_DROP_BUCKETS	32	/* one per bit of a class backlog */
 
 /*
- * Link speed in Mbps. System time V will be incremented at this rate and the
- * rate limits of flows (still using the weight variable) should be also
- * indicated in Mbps.
+ * Default link speed in Mbps. System time V will be incremented at this rate
+ * and the rate limits of flows (still using the weight variable) should be
+ * also indicated in Mbps.
  *
  * This value should actually be about 9844Mb/s but we leave it at
  * 9800 with the hope of having small queues in the NIC.  The reason
@@ -114,15 +104,86 @@
  * inter-packet gap (0.0096us for 10GbE = 12B).  Thus the max
  * achievable data rate is MTU / (MTU + 24), which is 0.98439 with MTU
  * = 1500B and and 0.99734 with MTU=9000B.
+ *
+ * Setting the overhead module parameter to 24 charges these bytes to every
+ * frame on the wire instead, after which link_speed can be set to the true
+ * line rate (10000 for 10GbE).
  */
 #define LINK_SPEED		9800	// 10Gbps link
-#define QFQ_DRAIN_RATE		((u64)LINK_SPEED * 125000 * ONE_FP / NSEC_PER_SEC)
+
+static unsigned int link_speed = LINK_SPEED;
+module_param    (link_speed, uint, 0640);
+MODULE_PARM_DESC(link_speed, "Link speed in Mbps that system time V advances at. Read when the qdisc is created.");
+
+static unsigned int overhead;
+module_param    (overhead, uint, 0640);
+MODULE_PARM_DESC(overhead, "Bytes charged per frame on the wire in addition to the packet length (24 for Ethernet preamble, FCS and IFG). Read when the qdisc is created.");
 
 static int spin_cpu = 2;
 /* Module parameter and sysfs export */
 module_param    (spin_cpu, int, 0640);
 MODULE_PARM_DESC(spin_cpu, "CPU to spin on. Ensure no processes are scheduled here to minimise context switches.");
 
+static bool light_classes;
+module_param    (light_classes, bool, 0640);
+MODULE_PARM_DESC(light_classes, "Create new classes without a child qdisc. Packets are queued in a small built-in fifo.");
+
+enum qfq_txq_policy {
+	QFQ_TXQ_HASH,		/* skb_tx_hash() on every packet */
+	QFQ_TXQ_SPINNER,	/* XPS queue of the spinner CPU */
+	QFQ_TXQ_CLASS,		/* One queue per class, from the class minor */
+	__QFQ_TXQ_MAX
+};
+
+static int txq_policy = QFQ_TXQ_HASH;
+module_param    (txq_policy, int, 0640);
+MODULE_PARM_DESC(txq_policy, "Transmit queue selection: 0 hashes every packet, 1 sends everything on the spinner CPU's XPS queue, 2 pins each class to a queue. Read when the qdisc is created.");
+
+enum qfq_clock {
+	QFQ_CLOCK_KTIME,	/* ktime_get() */
+	QFQ_CLOCK_LOCAL,	/* local_clock() of the spinner CPU */
+	__QFQ_CLOCK_MAX
+};
+
+static int clock_source = QFQ_CLOCK_KTIME;
+module_param    (clock_source, int, 0640);
+MODULE_PARM_DESC(clock_source, "Clock that drives system time V: 0 for ktime_get, 1 for local_clock, which is cheaper and monotonic on the pinned spinner CPU. Read when the qdisc is created.");
+
+static unsigned int buffer_delay_us;
+module_param    (buffer_delay_us, uint, 0640);
+MODULE_PARM_DESC(buffer_delay_us, "Limit the queue of each class to this many microseconds of traffic at its rate, 0 for packet limits only. Read when the qdisc is created.");
+
+static unsigned int idle_credit_us;
+module_param    (idle_credit_us, uint, 0640);
+MODULE_PARM_DESC(idle_credit_us, "Most microseconds of real time V advances over in one step while classes are backlogged, e.g. after the spinner was held off. Time beyond it is not credited, so classes do not burst to catch up. 0 for no cap. Read when the qdisc is created.");
+
+static unsigned long mem_budget;
+module_param    (mem_budget, ulong, 0640);
+MODULE_PARM_DESC(mem_budget, "Bytes all classes of a qdisc may queue together, 0 for no limit. Over budget the class with the largest backlog loses packets first. Read when the qdisc is created.");
+
+static unsigned int stats_map_entries;
+module_param    (stats_map_entries, uint, 0640);
+MODULE_PARM_DESC(stats_map_entries, "Classes whose counters each qdisc exports in its mmap-able debugfs stats_map file, 0 disables the file. Read when the qdisc is created.");
+
+static unsigned int log_subbufs;
+module_param    (log_subbufs, uint, 0640);
+MODULE_PARM_DESC(log_subbufs, "Log every dequeued packet to relay files in the debugfs directory of each qdisc, in this many sub-buffers of 256KB per CPU. 0 disables the log. Read when the qdisc is created.");
+
+static struct kmem_cache *qfq_class_cachep __read_mostly;
+static struct dentry *qfq_debugfs_root;
+
+/* Qdiscs with debug files, see qfq_debugfs_get() */
+static DECLARE_RWSEM(qfq_debugfs_sem);
+static LIST_HEAD(qfq_debugfs_list);
+
+/* Spinner phase profiling, switched on through debugfs qfq/profile */
+static struct static_key qfq_profile_key = STATIC_KEY_INIT_FALSE;
+static DEFINE_MUTEX(qfq_profile_lock);
+static bool qfq_profile_on;
+
+/* Enabled while any qdisc has a packet log, see qfq_log_packet() */
+static struct static_key qfq_log_key = STATIC_KEY_INIT_FALSE;
+
 /*
  * Possible group states.  These values are used as indexes for the bitmaps
  * array of struct qfq_queue.
@@ -130,18 +191,13 @@ MODULE_PARM_DESC(spin_cpu, "CPU to spin on. Ensure no processes are scheduled he
 enum qfq_state { ER, IR, EB, IB, QFQ_MAX_STATE };
 
 struct qfq_group;
+struct qfq_class;
 
-struct qfq_class {
-	struct Qdisc_class_common common;
-
-	unsigned int refcnt;
-	unsigned int filter_cnt;
-
-	struct gnet_stats_basic_packed bstats;
-	struct gnet_stats_queue qstats;
-	struct gnet_stats_rate_est rate_est;
-	struct Qdisc *qdisc;
-
+/*
+ * Scheduling state of a class in one tier, see struct qfq_tier. Slot lists
+ * link entities, which lead back to their class.
+ */
+struct qfq_entity {
 	struct hlist_node next;	/* Link for the slot list. */
 	u64 S, F;		/* flow timestamps (exact) */
 
@@ -155,6 +211,83 @@ struct qfq_class {
 	u32	inv_w;		/* ONE_FP/weight */
 	u32	lmax;		/* Max packet size for this flow. */
 
+	struct qfq_class *cl;
+};
+
+struct qfq_class {
+	/* Scheduling state used by the spinner on every dequeue. Kept at the
+	 * start of the structure so that it shares a single cache line.
+	 */
+	struct qfq_entity ent;	/* In the guaranteed tier */
+
+	/* Child qdisc, or NULL for a lightweight class which queues packets
+	 * in its built-in fifo instead.
+	 */
+	struct Qdisc *qdisc;
+
+	u16 txq;		/* Transmit queue, set on activation unless the
+				 * qdisc hashes every packet.
+				 */
+
+	/* Configuration and statistics, not used on the dequeue path. */
+	u32 classid;
+	struct hlist_node hnode[2];	/* Links for the class table, see
+					 * struct qfq_class_table.
+					 */
+	struct rcu_head rcu;
+
+	unsigned int refcnt;
+	unsigned int filter_cnt;
+
+	struct gnet_stats_basic_packed bstats;
+	struct gnet_stats_queue qstats;
+
+	/* Rate estimator run by the spinner, see qfq_est_update() */
+	u64	est_interval;		/* ns, 0 if there is no estimator */
+	u32	est_ewma_log;
+	u64	est_last;		/* Time of the last estimate */
+	u64	est_bytes;		/* Dequeued since est_last */
+	u32	est_packets;
+	u64	est_bps;		/* EWMA of bytes/s, scaled by 2^5 */
+	u64	est_pps;		/* EWMA of packets/s, scaled by 2^5 */
+
+	struct sk_buff_head fifo;	/* Queue of a lightweight class */
+	u32	limit;			/* Max packets in fifo */
+	u32	byte_limit;		/* Max bytes queued, 0 if unlimited */
+
+	/* Drop victim selection, see qfq_drop_raise() */
+	struct list_head drop_node;
+	unsigned int drop_bucket;	/* fls(backlog), 0 if not listed */
+
+	/* inv_w and lmax as last set from the control path. The spinner
+	 * copies them to inv_w and lmax when it processes the update.
+	 */
+	u32	cfg_inv_w;
+	u32	cfg_lmax;
+
+	/* ECN marking at dequeue, 0 disables a threshold */
+	u32	ecn_thresh;		/* packets left in the class */
+	u64	ecn_target;		/* sojourn time in ns */
+	u64	ecn_mark;		/* packets marked CE */
+
+	int	map_idx;		/* Entry in the stats map, -1 if none */
+	bool	prio;			/* Strict priority class, see
+					 * qfq_prio_dequeue()
+					 */
+	bool	dead;			/* Deleted, set under the class lock */
+
+	/* Service lag, maintained by the spinner, see qfq_lag_update() */
+	u64	lag_start;		/* Activation time, 0 while idle */
+	u64	lag_served;		/* Bytes dequeued since lag_start */
+	u64	lag_max;		/* Largest shortfall seen, in bytes */
+
+	/* Service above the weight, up to the ceiling */
+	u32	ceil;			/* Mbps, 0 if none */
+	struct qfq_entity xs;		/* In the excess tier, scheduled at
+					 * ceil - weight
+					 */
+	u64	excess_packets;
+
 //	/* stats variables */
 //	u64 idle_on_deq; /* Class was idle after a dequeue from this class */
 //	s64 prev_dequeue_time_ns;
@@ -175,19 +308,22 @@ struct qfq_group {
 	struct hlist_head slots[QFQ_MAX_SLOTS];
 };
 
-struct qfq_sched {
-	struct tcf_proto *filter_list;
-	struct Qdisc_class_hash clhash;
-
+/*
+ * Virtual time and groups of one tier of the scheduler. Every class is
+ * scheduled at its weight in the guaranteed tier. A class with a ceiling
+ * above its weight is also scheduled at the difference in the excess tier,
+ * which is only served when the guaranteed tier has no eligible class. V of
+ * the excess tier runs in real time, including while the link carries other
+ * packets, so a class reaches its ceiling whatever the guaranteed tier
+ * sends.
+ */
+struct qfq_tier {
 	u64		V;		/* Precise virtual time. */
-	u32		wsum;		/* weight sum */
 	u32		wsum_active;	/* weight sum of active classes */
 
 	unsigned long bitmaps[QFQ_MAX_STATE];	    /* Group bitmaps. */
 	struct qfq_group groups[QFQ_MAX_INDEX + 1]; /* The groups. */
 
-	struct task_struct *spinner;
-
 	/* real time maintenance */
 	u64		v_last_updated;	/* Time when V was last updated */
 	u64		v_diff_sum;	/* Running count of how much V should be
@@ -197,1350 +333,4216 @@ struct qfq_sched {
 					 * psched_ticks) over which V should be
 					 * incremented by v_diff_sum.
 					 */
+};
 
-//	/* stats variables */
-//	u64	v_forwarded;	/* V was forward to match S of some group in
-//				 * order to avoid a non work conserving
-//				 * schedule
-//				 */
-//	u64	idle_on_deq; /* Qdisc was idle after a dequeue operation */
-//	u64	update_grp_on_deq; /* Group needed update upon dequeue */
-//	u64	txq_blocked; /* Interface frozen or stopped while trying to
-//			      * transmit skb. For each skb dequeued from qdisc,
-//			      * we increment this value at most once (not for
-//			      * each time we retry).
-//			      */
+/*
+ * Hash table of classes keyed by classid.
+ *
+ * Lookups from the enqueue path do not take any lock and only rely on RCU.
+ * The table is modified from the control path only, which is serialized by
+ * RTNL. Each class has two hash nodes: a table links the classes using node
+ * node_ver, so the table can be grown by linking all classes into a new table
+ * through the other node while readers keep walking the old one. The new
+ * table is then published with rcu_assign_pointer and the old one is freed
+ * after a grace period.
+ */
+struct qfq_class_table {
+	unsigned int size;		/* Number of buckets, a power of two */
+	unsigned int count;		/* Number of classes in the table */
+	unsigned int node_ver;		/* Index of qfq_class::hnode in use */
+	struct hlist_head buckets[0];
+};
+
+#define QFQ_TABLE_MIN_SIZE	16
+
+/* Phases of the spinner loop, see qfq_phase_start() */
+enum qfq_phase {
+	QFQ_PHASE_WAIT,		/* qfq_spinner_wait_for_skb */
+	QFQ_PHASE_ACTIVATE,	/* qfq_spinner_activate_classes */
+	QFQ_PHASE_RETRY,	/* qfq_spinner_retry_parked */
+	QFQ_PHASE_DEQUEUE,	/* qfq_dequeue, including QFQ_PHASE_TXQ */
+	QFQ_PHASE_TXQ,		/* qfq_select_txq */
+	QFQ_PHASE_XMIT,		/* qfq_spinner_xmit */
+	__QFQ_PHASE_MAX
+};
+
+static const char * const qfq_phase_names[__QFQ_PHASE_MAX] = {
+	[QFQ_PHASE_WAIT]	= "wait",
+	[QFQ_PHASE_ACTIVATE]	= "activate",
+	[QFQ_PHASE_RETRY]	= "retry",
+	[QFQ_PHASE_DEQUEUE]	= "dequeue",
+	[QFQ_PHASE_TXQ]		= "txq",
+	[QFQ_PHASE_XMIT]	= "xmit",
+};
+
+struct qfq_phase_stats {
+	u64 calls;
+	u64 cycles;
+	u64 max;
+};
+
+/*
+ * Copy of the scheduler state taken by the spinner between two dequeues, for
+ * the debugfs state file. Slot occupancy is indexed relative to grp->front,
+ * the same way as full_slots.
+ */
+#define QFQ_SNAP_TOP	16
+
+struct qfq_snap_group {
+	u64 S, F;
+	unsigned int front;
+	unsigned long full_slots;
+	unsigned int slot_len[QFQ_MAX_SLOTS];
+};
+
+struct qfq_snap_class {
+	u32 classid;
+	bool excess;			/* Only in the excess tier */
+	unsigned int index;
+	unsigned int backlog;
+	unsigned int qlen;
+	u64 S, F;
+};
+
+struct qfq_snapshot {
+	struct completion done;
+	u64 now, V;
+	u32 wsum, wsum_active;
+	u64 excess_V;
+	u32 xs_wsum, excess_wsum_active;
+	unsigned int qlen;
+	unsigned int nr_active;		/* Classes found in the slots */
+	unsigned long bitmaps[QFQ_MAX_STATE];
+	struct qfq_snap_group groups[QFQ_MAX_INDEX + 1];
+	unsigned long excess_bitmaps[QFQ_MAX_STATE];
+	struct qfq_snap_group excess_groups[QFQ_MAX_INDEX + 1];
+	unsigned int nr_top;
+	struct qfq_snap_class top[QFQ_SNAP_TOP];	/* Largest backlog first */
+};
+
+struct qfq_sched {
+	struct tcf_proto *filter_list;
+	struct qfq_class_table __rcu *cltable;
+
+	u32		wsum;		/* weight sum */
+	u32		xs_wsum;	/* Sum of ceil - weight, bounded like wsum */
+	struct qfq_tier	guar;		/* Classes at their weight */
+	struct qfq_tier	excess;		/* Classes between weight and ceil */
+
+	struct task_struct *spinner;
+
+	u64		idle_credit;	/* ns, 0 if unbounded */
+	u64		credit_capped;	/* Updates that hit idle_credit */
+	u64		credit_dropped;	/* ns not credited to V */
+
+	/* Strict priority class, see qfq_prio_dequeue() */
+	struct qfq_class __rcu *prio_cl;
+	unsigned long	prio_pending;	/* Set on enqueue to prio_cl */
+	u32		prio_rate;	/* Mbps */
+	u32		prio_burst;	/* bytes */
+	s64		prio_tokens;	/* ns of transmission at prio_rate */
+	u64		prio_t_last;	/* Time of the last refill */
+	u64		prio_packets;
+	u64		prio_throttled;
+
+	/* link parameters, fixed at qdisc creation */
+	u32		link_speed;	/* Mbps */
+	u32		overhead;	/* Bytes charged per frame */
+	int		txq_policy;	/* enum qfq_txq_policy */
+	int		clock;		/* enum qfq_clock */
+	u64		drain_rate;	/* link_speed in bytes/ns, scaled by
+					 * ONE_FP.
+					 */
+
+	/* stats variables, owned by the spinner */
+	u64	v_forwarded;	/* V was advanced at the drain rate with no
+				 * eligible and ready group, to reach S of
+				 * some group.
+				 */
+	u64	idle_on_deq; /* Qdisc was idle after a dequeue operation */
+	u64	update_grp_on_deq; /* Group needed update upon dequeue */
+	u64	activations;	/* Work entries processed */
+	u64	activation_passes; /* Passes over the work queues with work */
+	u32	work_depth_max;	/* Most entries queued at the start of a pass */
+	u32	work_pass_max;	/* Most entries processed in one pass */
+	u64	work_deferred;	/* Passes that left work for the next */
+	u64	lag_max;	/* Largest cl->lag_max of any class */
+	u64	excess_packets;	/* Sent from the excess tier */
+	u64	spin_busy;	/* Spinner iterations that dequeued a packet */
+	u64	spin_idle;	/* Spinner iterations that did not */
+	u64	txq_blocked; /* Transmit queue stalls, summed over the
+			      * queues of the device.
+			      */
 
 	/* Per CPU locking and queues */
 	unsigned long work_bitmap; /* Indicates scheduled work on different
 				    * CPUs. Bit i is set if CPU i has
 				    * scheduled activation work.
 				    */
+	unsigned long work_cpus; /* CPUs whose queue the spinner is draining,
+				  * owned by the spinner.
+				  */
 	struct qfq_cpu_work_queue __percpu *work_queue; /* Per CPU work queues
 							 * which indicate that
 							 * some classes have to
 							 * be activated on this
 							 * CPU.
 							 */
+
+	/* Transmit queue state, owned by the spinner */
+	struct qfq_txq	*txqs;		/* One entry per device tx queue */
+	unsigned int	num_txqs;
+	unsigned int	nr_parked;	/* Entries with a parked packet */
+
+	struct dentry	*debugfs_dir;
+	struct list_head debugfs_node;	/* On qfq_debugfs_list */
+
+	/* Memory budget, fixed at qdisc creation */
+	u32		buffer_delay;	/* us of traffic a class may queue */
+	unsigned long	mem_budget;	/* Bytes, 0 if unlimited */
+	atomic_long_t	backlog;	/* Bytes queued in all classes, only
+					 * kept with a budget.
+					 */
+
+	struct qfq_drop_stats __percpu *drop_stats;
+
+	struct qfq_phase_stats phases[__QFQ_PHASE_MAX]; /* Owned by spinner */
+
+	struct qfq_snapshot *snap_req;	/* Snapshot the spinner should take */
+	unsigned long	reset_pending;	/* Set by qfq_reset_qdisc() */
+
+	/* mmap-able class counters, see qfq_map_publish() */
+	struct tc_qfq_map_hdr *map;	/* NULL if disabled */
+	size_t map_size;
+	unsigned long *map_ids;		/* Entries in use */
+
+	struct rchan *log;		/* Packet log, NULL if disabled */
+	u64 log_lost;			/* Records dropped on full buffers */
+
+	/* Backlogged classes by log2 of their backlog in bytes */
+	spinlock_t	drop_lock;
+	unsigned long	drop_map;	/* Bit i set if bucket i is not empty */
+	struct list_head drop_buckets[QFQ_DROP_BUCKETS];
+};
+
+/*
+ * A transmit queue stalls when it cannot take the packet the scheduler picked
+ * for it. At most one packet, the one the driver refused, is parked per
+ * queue; while it is parked no other packet is dequeued for that queue.
+ */
+struct qfq_txq {
+	struct sk_buff	*parked;
+	bool		stalled;	/* Stalled since the last transmit */
+	u64		stalls;		/* Number of stalls */
+};
+
+enum qfq_drop_reason {
+	QFQ_DROP_CLASSIFY,	/* No class for the packet */
+	QFQ_DROP_LIMIT,		/* Class queue full */
+	QFQ_DROP_ACTIVATE,	/* Class could not be activated */
+	QFQ_DROP_BUDGET,	/* Over the qdisc memory budget */
+	QFQ_DROP_PARENT,	/* Dropped on request of a parent qdisc */
+	__QFQ_DROP_MAX
+};
+
+/*
+ * Qdisc drops, counted per CPU since they happen on the enqueue path of all
+ * CPUs, and summed into sch->qstats.drops when dumped.
+ */
+struct qfq_drop_stats {
+	u64 drops[__QFQ_DROP_MAX];
 };
 
 struct qfq_cpu_work_queue {
 	struct list_head list; /* Head of the work queue */
 	spinlock_t lock;
+	unsigned int len; /* Entries on the list */
+	u64 head_time; /* Time of the first entry as last seen by the spinner */
+};
+
+enum qfq_work_type {
+	QFQ_WORK_ACTIVATE,	/* Class went from idle to backlogged */
+	QFQ_WORK_UPDATE,	/* Class weight or lmax was changed */
+	QFQ_WORK_REMOVE,	/* Class queue was purged */
 };
 
 struct qfq_cpu_work_entry {
-	struct qfq_class *cl; /* Class that has to be activated */
+	struct qfq_class *cl; /* Class that has to be activated or updated */
+	enum qfq_work_type type;
 	unsigned int pkt_len; /* Length of enqueued packet */
+	u64 time; /* qfq_now() when the entry was queued */
+	u32 lmax, inv_w, xs_inv_w; /* New class parameters (QFQ_WORK_UPDATE) */
+	struct completion *done; /* Completed instead of freeing the entry */
 	struct list_head list;
 };
 
-static struct qfq_class *qfq_find_class(struct Qdisc *sch, u32 classid)
+static struct qfq_class_table *qfq_table_alloc(unsigned int size)
 {
-	struct qfq_sched *q = qdisc_priv(sch);
-	struct Qdisc_class_common *clc;
+	struct qfq_class_table *t;
+	size_t sz = sizeof(*t) + size * sizeof(struct hlist_head);
+	unsigned int i;
 
-	clc = qdisc_class_find(&q->clhash, classid);
-	if (clc == NULL)
+	if (sz <= PAGE_SIZE)
+		t = kmalloc(sz, GFP_KERNEL);
+	else
+		t = vmalloc(sz);
+	if (t == NULL)
 		return NULL;
-	return container_of(clc, struct qfq_class, common);
+
+	t->size = size;
+	t->count = 0;
+	t->node_ver = 0;
+	for (i = 0; i < size; i++)
+		INIT_HLIST_HEAD(&t->buckets[i]);
+
+	return t;
 }
 
-static void qfq_purge_queue(struct qfq_class *cl)
+static void qfq_table_free(struct qfq_class_table *t)
 {
-	unsigned int len = cl->qdisc->q.qlen;
+	if (is_vmalloc_addr(t))
+		vfree(t);
+	else
+		kfree(t);
+}
 
-	qdisc_reset(cl->qdisc);
-	qdisc_tree_decrease_qlen(cl->qdisc, len);
+static inline struct hlist_head *qfq_table_bucket(struct qfq_class_table *t,
+						 u32 classid)
+{
+	return &t->buckets[qdisc_class_hash(classid, t->size - 1)];
 }
 
-static const struct nla_policy qfq_policy[TCA_QFQ_MAX + 1] = {
-	[TCA_QFQ_WEIGHT] = { .type = NLA_U32 },
-	[TCA_QFQ_LMAX] = { .type = NLA_U32 },
-};
+/* The class table as seen from the control path. */
+static inline struct qfq_class_table *qfq_table(struct qfq_sched *q)
+{
+	return rtnl_dereference(q->cltable);
+}
 
 /*
- * Calculate a flow index, given its weight and maximum packet length.
- * index = log_2(maxlen/weight) but we need to apply the scaling.
- * This is used only once at flow creation.
+ * Link all classes into a new table of the given size, through their other
+ * hash node. Lookups do not see the new table until it is assigned to
+ * q->cltable. Called under RTNL.
  */
-static int qfq_calc_index(u32 inv_w, unsigned int maxlen)
+static struct qfq_class_table *qfq_table_copy(struct qfq_sched *q,
+					      unsigned int size)
 {
-	u64 slot_size = (u64)maxlen * inv_w;
-	unsigned long size_map;
-	int index = 0;
+	struct qfq_class_table *old = qfq_table(q);
+	struct qfq_class_table *new;
+	struct qfq_class *cl;
+	unsigned int i;
 
-	if (inv_w == ONE_FP + 1)
-		goto out;
+	new = qfq_table_alloc(size);
+	if (new == NULL)
+		return NULL;
 
-	size_map = slot_size >> QFQ_MIN_SLOT_SHIFT;
-	if (!size_map)
-		goto out;
+	new->node_ver = !old->node_ver;
+	for (i = 0; i < old->size; i++) {
+		hlist_for_each_entry(cl, &old->buckets[i],
+				     hnode[old->node_ver]) {
+			hlist_add_head_rcu(&cl->hnode[new->node_ver],
+					   qfq_table_bucket(new, cl->classid));
+		}
+	}
+	new->count = old->count;
+	return new;
+}
 
-	index = __fls(size_map) + 1;	/* basically a log_2 */
-	index -= !(slot_size - (1ULL << (index + QFQ_MIN_SLOT_SHIFT - 1)));
+/*
+ * Move all classes to a new table of the given size. Called under RTNL.
+ *
+ * The resize is done in one go rather than bucket by bucket. Lookups are
+ * not held up by it either way: they keep walking the old table until the
+ * new one is published. What an incremental resize would spread out is the
+ * control path's cost, and that is already small. A doubling relinks each
+ * class once, which is O(1) per insert amortized. It waits for a single
+ * grace period, and a table grown from QFQ_TABLE_MIN_SIZE to 100k classes
+ * does that 13 times in all. An incremental resize still needs a grace
+ * period before the old table can be freed and its hash nodes reused. It
+ * would also make every lookup check two tables and every walk skip the
+ * classes already moved. The grace period cannot move into an RCU
+ * callback, because a large table is vmalloc'ed, and older kernels cannot
+ * vfree from softirq context.
+ */
+static int qfq_table_rehash(struct qfq_sched *q, unsigned int size)
+{
+	struct qfq_class_table *old = qfq_table(q);
+	struct qfq_class_table *new;
 
-	if (index < 0)
-		index = 0;
-out:
-	pr_debug("qfq calc_index: W = %lu, L = %u, I = %d\n",
-		 (unsigned long) ONE_FP/inv_w, maxlen, index);
+	new = qfq_table_copy(q, size);
+	if (new == NULL)
+		return -ENOMEM;
 
-	return index;
+	rcu_assign_pointer(q->cltable, new);
+
+	/* Wait for lookups still walking the old table (and thus possibly
+	 * using the hash nodes we will reuse on the next resize) to finish.
+	 */
+	synchronize_rcu_bh();
+	qfq_table_free(old);
+	return 0;
 }
 
-/* Length of the next packet (0 if the queue is empty). */
-static unsigned int qdisc_peek_len(struct Qdisc *sch)
+/* Insert into the given table without growing it. */
+static void __qfq_table_insert(struct qfq_class_table *t,
+			       struct qfq_class *cl)
 {
-	struct sk_buff *skb;
-
-	skb = sch->ops->peek(sch);
-	return skb ? qdisc_pkt_len(skb) : 0;
+	hlist_add_head_rcu(&cl->hnode[t->node_ver],
+			   qfq_table_bucket(t, cl->classid));
+	t->count++;
 }
 
-static void qfq_deactivate_class(struct qfq_sched *, struct qfq_class *);
-static void qfq_activate_class(struct qfq_sched *q, struct qfq_class *cl,
-			       unsigned int len);
-
-static void qfq_update_class_params(struct qfq_sched *q, struct qfq_class *cl,
-				    u32 lmax, u32 inv_w, int delta_w)
+static void qfq_table_insert(struct qfq_sched *q, struct qfq_class *cl)
 {
-	int i;
+	struct qfq_class_table *t = qfq_table(q);
 
-	/* update qfq-specific data */
-	cl->lmax = lmax;
-	cl->inv_w = inv_w;
-	i = qfq_calc_index(cl->inv_w, cl->lmax);
+	/* Keep the load factor at or below one. If growing fails we just
+	 * live with longer chains.
+	 */
+	if (t->count >= t->size)
+		qfq_table_rehash(q, t->size * 2);
 
-	cl->grp = &q->groups[i];
+	__qfq_table_insert(qfq_table(q), cl);
+}
 
-	q->wsum += delta_w;
+static void qfq_table_remove(struct qfq_sched *q, struct qfq_class *cl)
+{
+	struct qfq_class_table *t = qfq_table(q);
+
+	hlist_del_rcu(&cl->hnode[t->node_ver]);
+	t->count--;
 }
 
-static int qfq_change_class(struct Qdisc *sch, u32 classid, u32 parentid,
-			    struct nlattr **tca, unsigned long *arg)
+/*
+ * Can be called from the enqueue path without any lock (with BH disabled,
+ * as done by dev_queue_xmit) or from the control path under RTNL.
+ */
+static struct qfq_class *qfq_find_class(struct Qdisc *sch, u32 classid)
 {
 	struct qfq_sched *q = qdisc_priv(sch);
-	struct qfq_class *cl = (struct qfq_class *)*arg;
-	struct nlattr *tb[TCA_QFQ_MAX + 1];
-	u32 weight, lmax, inv_w;
-	int i, err;
-	int delta_w;
+	struct qfq_class_table *t;
+	struct qfq_class *cl;
 
-	if (tca[TCA_OPTIONS] == NULL) {
-		pr_notice("qfq: no options\n");
-		return -EINVAL;
+	t = rcu_dereference_bh_check(q->cltable, lockdep_rtnl_is_held());
+	hlist_for_each_entry_rcu(cl, qfq_table_bucket(t, classid),
+				 hnode[t->node_ver]) {
+		if (cl->classid == classid)
+			return cl;
 	}
 
-	err = nla_parse_nested(tb, TCA_QFQ_MAX, tca[TCA_OPTIONS], qfq_policy);
-	if (err < 0)
-		return err;
-
-	if (tb[TCA_QFQ_WEIGHT]) {
-		weight = nla_get_u32(tb[TCA_QFQ_WEIGHT]);
-		if (weight > (1UL << QFQ_MAX_WSHIFT)) {
-			pr_notice("qfq: invalid weight %u\n", weight);
-			return -EINVAL;
-		}
-	} else
-		weight = 1;
+	return NULL;
+}
 
-	inv_w = weight ? ONE_FP / weight : ONE_FP + 1;
-	weight = ONE_FP / inv_w;
-	delta_w = weight - (cl ? ONE_FP / cl->inv_w : 0);
-	if (q->wsum + delta_w > QFQ_MAX_WSUM) {
-		pr_notice("qfq: total weight out of range (%u + %u)\n",
-			  delta_w, q->wsum);
-		return -EINVAL;
-	}
+/*
+ * Queue sizing. With buffer_delay_us set a class may queue that much time
+ * worth of traffic at its configured rate, but never less than
+ * QFQ_MIN_BUFFER, which holds two maximum size GSO packets.
+ */
+#define QFQ_MIN_BUFFER		(2 * 65536)
 
-	if (tb[TCA_QFQ_LMAX]) {
-		lmax = nla_get_u32(tb[TCA_QFQ_LMAX]);
-		if (!lmax || lmax > (1UL << QFQ_MTU_SHIFT)) {
-			pr_notice("qfq: invalid max length %u\n", lmax);
-			return -EINVAL;
-		}
-	} else
-		lmax = 1UL << QFQ_MTU_SHIFT;
+static u32 qfq_class_buffer(const struct qfq_sched *q, u32 inv_w)
+{
+	u64 bytes;
 
-	if (cl != NULL) {
-		bool need_reactivation = false;
+	if (!q->buffer_delay)
+		return 0;
 
-		if (tca[TCA_RATE]) {
-			err = gen_replace_estimator(&cl->bstats, &cl->rate_est,
-						    qdisc_root_sleeping_lock(sch),
-						    tca[TCA_RATE]);
-			if (err)
-				return err;
-		}
+	/* weight is the rate in Mbps, and Mbps * us = bits */
+	bytes = (u64)(ONE_FP / inv_w) * q->buffer_delay / 8;
+	return clamp_t(u64, bytes, QFQ_MIN_BUFFER, U32_MAX);
+}
 
-		if (lmax == cl->lmax && inv_w == cl->inv_w)
-			return 0; /* nothing to update */
+/* Configuration as last set from the control path. */
+static void qfq_set_class_cfg(struct qfq_sched *q, struct qfq_class *cl,
+			      u32 lmax, u32 inv_w)
+{
+	cl->cfg_lmax = lmax;
+	cl->cfg_inv_w = inv_w;
+	/* The priority class is sized for its token bucket rate */
+	cl->byte_limit = qfq_class_buffer(q, cl->prio ? ONE_FP / q->prio_rate :
+						       inv_w);
+}
 
-		i = qfq_calc_index(inv_w, lmax);
-		sch_tree_lock(sch);
-		if (&q->groups[i] != cl->grp && cl->qdisc->q.qlen > 0 &&
-		    cl->inv_w != ONE_FP + 1) {
-			/*
-			 * shift cl->F back, to not charge the
-			 * class for the not-yet-served head
-			 * packet
-			 */
-			cl->F = cl->S;
-			/* remove class from its slot in the old group */
-			qfq_deactivate_class(q, cl);
-			if (inv_w != ONE_FP + 1)
-				need_reactivation = true;
-		}
+/*
+ * Accessors for the queue of a class. A class either has a child qdisc or,
+ * if it is a lightweight class, queues packets in its built-in fifo which is
+ * protected by the fifo lock.
+ */
+static inline spinlock_t *qfq_cl_lock(struct qfq_class *cl)
+{
+	return cl->qdisc ? qdisc_lock(cl->qdisc) : &cl->fifo.lock;
+}
 
-		if (cl->inv_w == ONE_FP + 1 && inv_w != ONE_FP + 1)
-			need_reactivation = true;
+static inline unsigned int qfq_cl_qlen(const struct qfq_class *cl)
+{
+	return cl->qdisc ? qdisc_qlen(cl->qdisc) : skb_queue_len(&cl->fifo);
+}
 
-		qfq_update_class_params(q, cl, lmax, inv_w, delta_w);
-		if (cl->qdisc->q.qlen > 0)
-			q->wsum_active += delta_w;
+static inline unsigned int qfq_cl_backlog(const struct qfq_class *cl)
+{
+	return cl->qdisc ? cl->qdisc->qstats.backlog : cl->qstats.backlog;
+}
 
-		if (need_reactivation) /* activate in new group */
-			qfq_activate_class(q, cl, qdisc_peek_len(cl->qdisc));
-		sch_tree_unlock(sch);
+/*
+ * Whether the packets of a class keep their enqueue time for ECN marking.
+ * It is stored in qdisc_skb_cb, where a child qdisc may keep its own state,
+ * so only a plain fifo child leaves it alone.
+ */
+static inline bool qfq_cl_stamped(const struct qfq_class *cl)
+{
+	return cl->ecn_target &&
+	       (!cl->qdisc || cl->qdisc->ops == &pfifo_qdisc_ops ||
+		cl->qdisc->ops == &bfifo_qdisc_ops);
+}
 
-		return 0;
-	}
-
-	cl = kzalloc(sizeof(struct qfq_class), GFP_KERNEL);
-	if (cl == NULL)
-		return -ENOBUFS;
-
-	cl->refcnt = 1;
-	cl->common.classid = classid;
-
-	qfq_update_class_params(q, cl, lmax, inv_w, delta_w);
+/*
+ * Drops are counted in cl->qstats, except those of a child qdisc which
+ * counts them itself.
+ */
+static int qfq_cl_enqueue(struct sk_buff *skb, struct qfq_class *cl)
+{
+	if (cl->byte_limit &&
+	    unlikely(qfq_cl_backlog(cl) + qdisc_pkt_len(skb) > cl->byte_limit)) {
+		cl->qstats.drops++;
+		kfree_skb(skb);
+		return NET_XMIT_DROP;
+	}
 
-	cl->qdisc = qdisc_create_dflt(sch->dev_queue,
-				      &pfifo_qdisc_ops, classid);
-	if (cl->qdisc == NULL)
-		cl->qdisc = &noop_qdisc;
+	if (cl->qdisc)
+		return qdisc_enqueue(skb, cl->qdisc);
 
-	if (tca[TCA_RATE]) {
-		err = gen_new_estimator(&cl->bstats, &cl->rate_est,
-					qdisc_root_sleeping_lock(sch),
-					tca[TCA_RATE]);
-		if (err) {
-			qdisc_destroy(cl->qdisc);
-			kfree(cl);
-			return err;
-		}
+	if (unlikely(skb_queue_len(&cl->fifo) >= cl->limit)) {
+		cl->qstats.drops++;
+		kfree_skb(skb);
+		return NET_XMIT_DROP;
 	}
 
-//	cl->prev_dequeue_time_ns = ktime_get().tv64;
-//	cl->inter_dequeue_time_ns = 0;
-//
-//	cl->expected_inter_dequeue_time_ns = 1482LLU * 8 * 1000 / weight;
-//	cl->absdev_dequeue_time_ns = 0;
+	cl->qstats.backlog += qdisc_pkt_len(skb);
+	__skb_queue_tail(&cl->fifo, skb);
+	return NET_XMIT_SUCCESS;
+}
 
-	sch_tree_lock(sch);
-	qdisc_class_hash_insert(&q->clhash, &cl->common);
-	sch_tree_unlock(sch);
+static struct sk_buff *qfq_cl_dequeue(struct qfq_class *cl)
+{
+	struct sk_buff *skb;
 
-	qdisc_class_hash_grow(sch, &q->clhash);
+	if (cl->qdisc)
+		return qdisc_dequeue_peeked(cl->qdisc);
 
-	*arg = (unsigned long)cl;
-	return 0;
+	skb = __skb_dequeue(&cl->fifo);
+	if (skb)
+		cl->qstats.backlog -= qdisc_pkt_len(skb);
+	return skb;
 }
 
-static void qfq_destroy_class(struct Qdisc *sch, struct qfq_class *cl)
+static struct sk_buff *qfq_cl_peek(struct qfq_class *cl)
 {
-	struct qfq_sched *q = qdisc_priv(sch);
+	if (cl->qdisc)
+		return cl->qdisc->ops->peek(cl->qdisc);
 
-	if (cl->inv_w) {
-		q->wsum -= ONE_FP / cl->inv_w;
-		if (qdisc_qlen(cl->qdisc))
-			q->wsum_active -= ONE_FP / cl->inv_w;
-		cl->inv_w = 0;
-	}
-
-	gen_kill_estimator(&cl->bstats, &cl->rate_est);
-	qdisc_destroy(cl->qdisc);
-	kfree(cl);
+	return skb_peek(&cl->fifo);
 }
 
-static int qfq_delete_class(struct Qdisc *sch, unsigned long arg)
+/* Drop a packet from the tail of the class queue, returns its length. */
+static unsigned int qfq_cl_drop(struct qfq_class *cl)
 {
-	struct qfq_sched *q = qdisc_priv(sch);
-	struct qfq_class *cl = (struct qfq_class *)arg;
+	struct sk_buff *skb;
+	unsigned int len;
 
-	if (cl->filter_cnt > 0)
-		return -EBUSY;
+	if (cl->qdisc)
+		return cl->qdisc->ops->drop ? cl->qdisc->ops->drop(cl->qdisc) : 0;
 
-	sch_tree_lock(sch);
+	skb = __skb_dequeue_tail(&cl->fifo);
+	if (!skb)
+		return 0;
 
-	if (cl->inv_w && qdisc_qlen(cl->qdisc))
-		q->wsum_active -= ONE_FP / cl->inv_w;
+	len = qdisc_pkt_len(skb);
+	cl->qstats.backlog -= len;
+	cl->qstats.drops++;
+	kfree_skb(skb);
+	return len;
+}
 
-	qfq_purge_queue(cl);
-	qdisc_class_hash_remove(&q->clhash, &cl->common);
+static void qfq_cl_reset(struct qfq_class *cl)
+{
+	if (cl->qdisc) {
+		qdisc_reset(cl->qdisc);
+		return;
+	}
 
-	BUG_ON(--cl->refcnt == 0);
-	/*
-	 * This shouldn't happen: we "hold" one cops->get() when called
-	 * from tc_ctl_tclass; the destroy method is done from cops->put().
-	 */
+	__skb_queue_purge(&cl->fifo);
+	cl->qstats.backlog = 0;
+}
 
-	sch_tree_unlock(sch);
-	return 0;
+/* Move a class to bucket b, 0 to unlist it. Called with the drop lock held. */
+static void qfq_drop_move(struct qfq_sched *q, struct qfq_class *cl,
+			  unsigned int b)
+{
+	if (cl->drop_bucket) {
+		list_del(&cl->drop_node);
+		if (list_empty(&q->drop_buckets[cl->drop_bucket - 1]))
+			__clear_bit(cl->drop_bucket - 1, &q->drop_map);
+	}
+	if (b) {
+		list_add_tail(&cl->drop_node, &q->drop_buckets[b - 1]);
+		__set_bit(b - 1, &q->drop_map);
+	}
+	cl->drop_bucket = b;
 }
 
-static unsigned long qfq_get_class(struct Qdisc *sch, u32 classid)
+/*
+ * With a memory budget, classes are kept in buckets by the log2 of their
+ * backlog in bytes, so that the victim of an eviction is found in constant
+ * time: a class of the highest non-empty bucket. Buckets are only raised
+ * here, when the backlog of a class grows past its bucket. A class whose
+ * backlog went down stays where it is until qfq_heaviest_class() comes
+ * across it, so the dequeue path never takes the drop lock, and neither does
+ * a class that refills up to a backlog it had before. Must be called with
+ * the class lock held after the backlog grew.
+ */
+static void qfq_drop_raise(struct qfq_sched *q, struct qfq_class *cl)
 {
-	struct qfq_class *cl = qfq_find_class(sch, classid);
+	unsigned int b;
 
-	if (cl != NULL)
-		cl->refcnt++;
+	if (!q->mem_budget)
+		return;
 
-	return (unsigned long)cl;
+	b = fls(qfq_cl_backlog(cl));
+	if (b <= ACCESS_ONCE(cl->drop_bucket))
+		return;
+
+	spin_lock(&q->drop_lock);
+	if (b > cl->drop_bucket)
+		qfq_drop_move(q, cl, b);
+	spin_unlock(&q->drop_lock);
 }
 
-static void qfq_put_class(struct Qdisc *sch, unsigned long arg)
+/* Take a class that goes away out of the buckets. */
+static void qfq_drop_unlist(struct qfq_sched *q, struct qfq_class *cl)
 {
-	struct qfq_class *cl = (struct qfq_class *)arg;
+	if (!cl->drop_bucket)
+		return;
 
-	if (--cl->refcnt == 0)
-		qfq_destroy_class(sch, cl);
+	spin_lock_bh(&q->drop_lock);
+	qfq_drop_move(q, cl, 0);
+	spin_unlock_bh(&q->drop_lock);
 }
 
-static struct tcf_proto **qfq_tcf_chain(struct Qdisc *sch, unsigned long cl)
+static inline struct tc_qfq_map_entry *qfq_map_entry(struct qfq_sched *q,
+						     int idx)
 {
-	struct qfq_sched *q = qdisc_priv(sch);
-
-	if (cl)
-		return NULL;
-
-	return &q->filter_list;
+	return (struct tc_qfq_map_entry *)(q->map + 1) + idx;
 }
 
-static unsigned long qfq_bind_tcf(struct Qdisc *sch, unsigned long parent,
-				  u32 classid)
+/*
+ * Copy the counters of a class to its entry of the stats map. All counters
+ * of a class change under the class lock, which also serializes the writers
+ * of its entry. Must be called with the class lock held.
+ */
+static void qfq_map_publish(struct qfq_sched *q, struct qfq_class *cl)
 {
-	struct qfq_class *cl = qfq_find_class(sch, classid);
+	struct tc_qfq_map_entry *e;
+	u32 drops = cl->qstats.drops;
 
-	if (cl != NULL)
-		cl->filter_cnt++;
+	if (cl->map_idx < 0)
+		return;
 
-	return (unsigned long)cl;
+	if (cl->qdisc)
+		drops += cl->qdisc->qstats.drops;
+
+	e = qfq_map_entry(q, cl->map_idx);
+	e->seq++;
+	smp_wmb();
+	e->bytes = cl->bstats.bytes;
+	e->packets = cl->bstats.packets;
+	e->drops = drops;
+	e->backlog = qfq_cl_backlog(cl);
+	e->qlen = qfq_cl_qlen(cl);
+	e->bps = (cl->est_bps + 0x1F) >> 5;
+	e->pps = (cl->est_pps + 0x1F) >> 5;
+	e->est_time = cl->est_last;
+	smp_wmb();
+	e->seq++;
 }
 
-static void qfq_unbind_tcf(struct Qdisc *sch, unsigned long arg)
+/* Stats map entries are handed out and returned from the control path. */
+static void qfq_map_attach(struct qfq_sched *q, struct qfq_class *cl)
 {
-	struct qfq_class *cl = (struct qfq_class *)arg;
+	unsigned long idx;
 
-	cl->filter_cnt--;
+	cl->map_idx = -1;
+	if (!q->map)
+		return;
+
+	idx = find_first_zero_bit(q->map_ids, q->map->nr_entries);
+	if (idx >= q->map->nr_entries)
+		return;
+
+	__set_bit(idx, q->map_ids);
+	cl->map_idx = idx;
+	qfq_map_entry(q, idx)->classid = cl->classid;
 }
 
-static int qfq_graft_class(struct Qdisc *sch, unsigned long arg,
-			   struct Qdisc *new, struct Qdisc **old)
+static void qfq_map_detach(struct qfq_sched *q, struct qfq_class *cl)
 {
-	struct qfq_class *cl = (struct qfq_class *)arg;
+	struct tc_qfq_map_entry *e;
+	spinlock_t *lock = qfq_cl_lock(cl);
+	int idx;
 
-	if (new == NULL) {
-		new = qdisc_create_dflt(sch->dev_queue,
-					&pfifo_qdisc_ops, cl->common.classid);
-		if (new == NULL)
-			new = &noop_qdisc;
-	}
+	if (cl->map_idx < 0)
+		return;
 
-	sch_tree_lock(sch);
-	qfq_purge_queue(cl);
-	*old = cl->qdisc;
-	cl->qdisc = new;
-	sch_tree_unlock(sch);
-	return 0;
+	/* A concurrent enqueue must not write to the entry once it is free */
+	spin_lock_bh(lock);
+	idx = cl->map_idx;
+	cl->map_idx = -1;
+	e = qfq_map_entry(q, idx);
+	e->seq++;
+	smp_wmb();
+	memset(&e->classid, 0, sizeof(*e) - offsetof(struct tc_qfq_map_entry,
+						       classid));
+	smp_wmb();
+	e->seq++;
+	spin_unlock_bh(lock);
+
+	__clear_bit(idx, q->map_ids);
 }
 
-static struct Qdisc *qfq_class_leaf(struct Qdisc *sch, unsigned long arg)
+static void qfq_spinner_remove_class(struct Qdisc *, struct qfq_class *);
+
+/*
+ * Start measuring the service of a class against its rate. V was brought up
+ * to date in this spinner iteration, so v_last_updated is the current time.
+ */
+static inline void qfq_lag_start(struct qfq_sched *q, struct qfq_class *cl)
 {
-	struct qfq_class *cl = (struct qfq_class *)arg;
+	cl->lag_start = q->guar.v_last_updated;
+	cl->lag_served = 0;
+}
 
-	return cl->qdisc;
+/*
+ * Drop all packets of a class. The class stays in the scheduler, which only
+ * the spinner changes, until a QFQ_WORK_REMOVE entry or the dequeue path
+ * finds it empty and takes it out.
+ */
+static void qfq_purge_queue(struct qfq_sched *q, struct qfq_class *cl)
+{
+	spinlock_t *lock = qfq_cl_lock(cl);
+
+	spin_lock_bh(lock);
+	if (q->mem_budget)
+		atomic_long_sub(qfq_cl_backlog(cl), &q->backlog);
+	qfq_cl_reset(cl);
+	qfq_map_publish(q, cl);
+	spin_unlock_bh(lock);
 }
 
-static int qfq_dump_class(struct Qdisc *sch, unsigned long arg,
-			  struct sk_buff *skb, struct tcmsg *tcm)
+static const struct nla_policy qfq_policy[TCA_QFQ_MAX + 1] = {
+	[TCA_QFQ_WEIGHT] = { .type = NLA_U32 },
+	[TCA_QFQ_LMAX] = { .type = NLA_U32 },
+	[TCA_QFQ_BATCH] = { .type = NLA_BINARY },
+	[TCA_QFQ_ECN_THRESH] = { .type = NLA_U32 },
+	[TCA_QFQ_ECN_TARGET] = { .type = NLA_U32 },
+	[TCA_QFQ_PRIO_RATE] = { .type = NLA_U32 },
+	[TCA_QFQ_PRIO_BURST] = { .type = NLA_U32 },
+	[TCA_QFQ_CEIL] = { .type = NLA_U32 },
+};
+
+/*
+ * Calculate a flow index, given its weight and maximum packet length.
+ * index = log_2(maxlen/weight) but we need to apply the scaling.
+ * This is used only once at flow creation.
+ */
+static int qfq_calc_index(u32 inv_w, unsigned int maxlen)
 {
-	struct qfq_class *cl = (struct qfq_class *)arg;
-	struct nlattr *nest;
+	u64 slot_size = (u64)maxlen * inv_w;
+	unsigned long size_map;
+	int index = 0;
 
-	tcm->tcm_parent	= TC_H_ROOT;
-	tcm->tcm_handle	= cl->common.classid;
-	tcm->tcm_info	= cl->qdisc->handle;
+	if (inv_w == ONE_FP + 1)
+		goto out;
 
-	nest = nla_nest_start(skb, TCA_OPTIONS);
-	if (nest == NULL)
-		goto nla_put_failure;
-	if (nla_put_u32(skb, TCA_QFQ_WEIGHT, ONE_FP/cl->inv_w) ||
-	    nla_put_u32(skb, TCA_QFQ_LMAX, cl->lmax))
-		goto nla_put_failure;
+	size_map = slot_size >> QFQ_MIN_SLOT_SHIFT;
+	if (!size_map)
+		goto out;
 
-	return nla_nest_end(skb, nest);
+	index = __fls(size_map) + 1;	/* basically a log_2 */
+	index -= !(slot_size - (1ULL << (index + QFQ_MIN_SLOT_SHIFT - 1)));
 
-nla_put_failure:
-	nla_nest_cancel(skb, nest);
-	return -EMSGSIZE;
+	if (index < 0)
+		index = 0;
+out:
+	pr_debug("qfq calc_index: W = %lu, L = %u, I = %d\n",
+		 (unsigned long) ONE_FP/inv_w, maxlen, index);
+
+	return index;
 }
 
-static int qfq_dump_class_stats(struct Qdisc *sch, unsigned long arg,
-				struct gnet_dump *d)
+/*
+ * Current time in ns. The spinner reads it once per iteration of its loop;
+ * with local_clock() this is a TSC read on the CPU it is pinned to. Reads
+ * on other CPUs, for ECN sojourn stamps and rate dumps, are then only
+ * comparable with it up to the skew between CPU clocks.
+ */
+static inline u64 qfq_now(const struct qfq_sched *q)
 {
-	struct qfq_class *cl = (struct qfq_class *)arg;
-	struct tc_qfq_xstats xstats = {.type = TCA_QFQ_XSTATS_CLASS};
-
-//	xstats.class_stats.idle_on_deq = cl->idle_on_deq;
-//	xstats.class_stats.inter_deq_time_ns = cl->inter_dequeue_time_ns;
-//	xstats.class_stats.absdev_deq_time_ns = cl->absdev_dequeue_time_ns;
-//	xstats.class_stats.expected_inter_dequeue_time_ns = cl->expected_inter_dequeue_time_ns;
+	if (q->clock == QFQ_CLOCK_LOCAL)
+		return local_clock();
+	return ktime_to_ns(ktime_get());
+}
 
-	cl->qdisc->qstats.qlen = cl->qdisc->q.qlen;
-	//printk(KERN_INFO "class %p inter_dequeue_time %lld\n", cl, cl->inter_dequeue_time_ns);
+/*
+ * Bytes the packet occupies on the wire. qdisc_pkt_len() already counts the
+ * headers of every GSO segment; the per-frame overhead is added once per
+ * segment as well.
+ */
+static inline unsigned int qfq_wire_len(const struct qfq_sched *q,
+					const struct sk_buff *skb)
+{
+	unsigned int segs = 1;
 
-	if (gnet_stats_copy_basic(d, &cl->bstats) < 0 ||
-	    gnet_stats_copy_rate_est(d, &cl->bstats, &cl->rate_est) < 0 ||
-	    gnet_stats_copy_queue(d, &cl->qdisc->qstats) < 0)
-		return -1;
+	if (skb_is_gso(skb))
+		segs = max_t(unsigned int, skb_shinfo(skb)->gso_segs, 1);
 
-	return gnet_stats_copy_app(d, &xstats, sizeof(xstats));
+	return qdisc_pkt_len(skb) + segs * q->overhead;
 }
 
-static void qfq_walk(struct Qdisc *sch, struct qdisc_walker *arg)
+/* Wire length of the next packet (0 if the queue is empty). */
+static unsigned int qfq_peek_len(const struct qfq_sched *q,
+				 struct qfq_class *cl)
 {
-	struct qfq_sched *q = qdisc_priv(sch);
-	struct qfq_class *cl;
-	unsigned int i;
+	struct sk_buff *skb;
 
-	if (arg->stop)
-		return;
+	skb = qfq_cl_peek(cl);
+	return skb ? qfq_wire_len(q, skb) : 0;
+}
 
-	for (i = 0; i < q->clhash.hashsize; i++) {
-		hlist_for_each_entry(cl, &q->clhash.hash[i], common.hnode) {
-			if (arg->count < arg->skip) {
-				arg->count++;
-				continue;
-			}
-			if (arg->fn(sch, (unsigned long)cl, arg) < 0) {
-				arg->stop = 1;
-				return;
-			}
-			arg->count++;
-		}
+static void qfq_activate_class(struct qfq_sched *q, struct qfq_class *cl,
+			       unsigned int len);
+static void qfq_deactivate_ent(struct qfq_tier *t, struct qfq_entity *e);
+static void qfq_excess_activate(struct qfq_sched *q, struct qfq_class *cl,
+				unsigned int len);
+static void qfq_excess_deactivate(struct qfq_sched *q, struct qfq_class *cl);
+
+/* XPS queue of the CPU we run on, which for the spinner is spin_cpu. */
+static u16 qfq_spinner_txq(struct net_device *dev)
+{
+	int queue_index = -1;
+#ifdef CONFIG_XPS
+	struct xps_dev_maps *dev_maps;
+	struct xps_map *map;
+
+	rcu_read_lock();
+	dev_maps = rcu_dereference(dev->xps_maps);
+	if (dev_maps) {
+		map = rcu_dereference(dev_maps->cpu_map[smp_processor_id()]);
+		if (map && map->len)
+			queue_index = map->queues[0];
 	}
+	rcu_read_unlock();
+#endif
+	if (queue_index < 0 || queue_index >= dev->real_num_tx_queues)
+		queue_index = smp_processor_id() % dev->real_num_tx_queues;
+	return queue_index;
 }
 
-static struct qfq_class *qfq_classify(struct sk_buff *skb, struct Qdisc *sch,
-				      int *qerr)
+/*
+ * Choose the transmit queue of a class that is being activated. It is kept
+ * while the class stays backlogged, so the packets of a class are not spread
+ * over queues and cannot be reordered by the NIC.
+ */
+static void qfq_bind_txq(struct Qdisc *sch, struct qfq_class *cl)
 {
 	struct qfq_sched *q = qdisc_priv(sch);
-	struct qfq_class *cl;
-	struct tcf_result res;
-	int result;
-
-	if (likely(skb->sk && skb->sk->qdisc_cache == sch && skb->sk->cl_cache)) {
-		return skb->sk->cl_cache;
+	struct net_device *dev = qdisc_dev(sch);
+
+	switch (q->txq_policy) {
+	case QFQ_TXQ_SPINNER:
+		cl->txq = qfq_spinner_txq(dev);
+		break;
+	case QFQ_TXQ_CLASS:
+		cl->txq = TC_H_MIN(cl->classid) % dev->real_num_tx_queues;
+		break;
 	}
+}
 
-	if (TC_H_MAJ(skb->priority ^ sch->handle) == 0) {
-		pr_debug("qfq_classify: found %d\n", skb->priority);
-		cl = qfq_find_class(sch, skb->priority);
-		if (cl != NULL)
-			return cl;
-	}
+/* Place an entity in the group of its tier for its weight and lmax. */
+static void qfq_set_ent_params(struct qfq_tier *t, struct qfq_entity *e,
+			       u32 lmax, u32 inv_w)
+{
+	e->lmax = lmax;
+	e->inv_w = inv_w;
+	e->grp = &t->groups[qfq_calc_index(inv_w, lmax)];
+}
 
-	*qerr = NET_XMIT_SUCCESS | __NET_XMIT_BYPASS;
-	result = tc_classify(skb, q->filter_list, &res);
-	if (result >= 0) {
-#ifdef CONFIG_NET_CLS_ACT
-		switch (result) {
-		case TC_ACT_QUEUED:
-		case TC_ACT_STOLEN:
-			*qerr = NET_XMIT_SUCCESS | __NET_XMIT_STOLEN;
-		case TC_ACT_SHOT:
-			return NULL;
-		}
-#endif
-		cl = (struct qfq_class *)res.class;
-		if (cl == NULL)
-			cl = qfq_find_class(sch, res.classid);
-		return cl;
-	}
+static void qfq_update_class_params(struct qfq_sched *q, struct qfq_class *cl,
+				    u32 lmax, u32 inv_w, int delta_w)
+{
+	/* update qfq-specific data */
+	qfq_set_ent_params(&q->guar, &cl->ent, lmax, inv_w);
 
-	return NULL;
+	q->wsum += delta_w;
 }
 
-/* Generic comparison function, handling wraparound. */
-static inline int qfq_gt(u64 a, u64 b)
+/* inv_w of a class in the excess tier, ONE_FP + 1 if it has no ceiling. */
+static u32 qfq_excess_inv_w(u32 inv_w, u32 ceil)
 {
-	return (s64)(a - b) > 0;
+	u32 weight = ONE_FP / inv_w;
+
+	return ceil > weight ? ONE_FP / (ceil - weight) : ONE_FP + 1;
 }
 
-/* Round a precise timestamp to its slotted value. */
-static inline u64 qfq_round_down(u64 ts, unsigned int shift)
+/* Weight of a class in the excess tier, as counted in xs_wsum */
+static inline u32 qfq_excess_w(u32 inv_w, u32 ceil)
 {
-	return ts & ~((1ULL << shift) - 1);
+	return ONE_FP / qfq_excess_inv_w(inv_w, ceil);
 }
 
-/* return the pointer to the group with lowest index in the bitmap */
-static inline struct qfq_group *qfq_ffs(struct qfq_sched *q,
-					unsigned long bitmap)
+/* A class is active, and counted in sch->q.qlen, while in either tier. */
+static inline bool qfq_cl_active(const struct qfq_class *cl)
 {
-	int index = __ffs(bitmap);
-	return &q->groups[index];
+	return !hlist_unhashed(&cl->ent.next) || !hlist_unhashed(&cl->xs.next);
 }
-/* Calculate a mask to mimic what would be ffs_from(). */
-static inline unsigned long mask_from(unsigned long bitmap, int from)
+
+static void qfq_apply_guar_params(struct qfq_sched *q, struct qfq_class *cl,
+				  u32 lmax, u32 inv_w)
 {
-	return bitmap & ~((1UL << from) - 1);
+	bool active = !hlist_unhashed(&cl->ent.next);
+	int i;
+
+	if (lmax == cl->ent.lmax && inv_w == cl->ent.inv_w)
+		return; /* nothing to update */
+
+	i = qfq_calc_index(inv_w, lmax);
+	if (!active) {
+		/* A class whose weight was zero was never activated here. */
+		if (cl->ent.inv_w == ONE_FP + 1 && inv_w != ONE_FP + 1 &&
+		    qfq_cl_qlen(cl) > 0) {
+			qfq_update_class_params(q, cl, lmax, inv_w, 0);
+			qfq_activate_class(q, cl, qfq_peek_len(q, cl));
+			q->guar.wsum_active += ONE_FP / inv_w;
+		} else
+			qfq_update_class_params(q, cl, lmax, inv_w, 0);
+		return;
+	}
+
+	q->guar.wsum_active -= ONE_FP / cl->ent.inv_w;
+	q->guar.wsum_active += ONE_FP / inv_w;
+	if (&q->guar.groups[i] == cl->ent.grp && inv_w != ONE_FP + 1) {
+		/* Same group, the new weight is used from the next packet. */
+		qfq_update_class_params(q, cl, lmax, inv_w, 0);
+		qfq_lag_start(q, cl);
+		return;
+	}
+
+	/*
+	 * Remove class from its slot in the old group. This also shifts F
+	 * back, to not charge the class for the not-yet-served head packet.
+	 */
+	qfq_deactivate_ent(&q->guar, &cl->ent);
+	cl->lag_start = 0;
+	qfq_update_class_params(q, cl, lmax, inv_w, 0);
+	if (inv_w != ONE_FP + 1)
+		qfq_activate_class(q, cl, qfq_peek_len(q, cl));
 }
 
 /*
- * The state computation relies on ER=0, IR=1, EB=2, IB=3
- * First compute eligibility comparing grp->S, q->V,
- * then check if someone is blocking us and possibly add EB
+ * Apply new parameters to an existing class. Called from the spinner when it
+ * processes a QFQ_WORK_UPDATE entry, so that the scheduler state is only ever
+ * changed by the spinner thread.
  */
-static int qfq_calc_state(struct qfq_sched *q, const struct qfq_group *grp)
+static void qfq_apply_class_params(struct Qdisc *sch, struct qfq_class *cl,
+				   u32 lmax, u32 inv_w, u32 xs_inv_w)
 {
-	/* if S > V we are not eligible */
-	unsigned int state = qfq_gt(grp->S, q->V);
-	unsigned long mask = mask_from(q->bitmaps[ER], grp->index);
-	struct qfq_group *next;
+	struct qfq_sched *q = qdisc_priv(sch);
+	bool was_active = qfq_cl_active(cl);
 
-	if (mask) {
-		next = qfq_ffs(q, mask);
-		if (qfq_gt(grp->F, next->F))
-			state |= EB;
+	qfq_apply_guar_params(q, cl, lmax, inv_w);
+
+	if (lmax != cl->xs.lmax || xs_inv_w != cl->xs.inv_w) {
+		/* Back in with a start time for the new rate */
+		qfq_excess_deactivate(q, cl);
+		qfq_set_ent_params(&q->excess, &cl->xs, lmax, xs_inv_w);
+		if (qfq_cl_qlen(cl) > 0)
+			qfq_excess_activate(q, cl, qfq_peek_len(q, cl));
 	}
 
-	return state;
+	if (!was_active && qfq_cl_active(cl)) {
+		qfq_bind_txq(sch, cl);
+		++sch->q.qlen;
+	} else if (was_active && !qfq_cl_active(cl))
+		sch->q.qlen--;
 }
 
+static struct qfq_cpu_work_entry *qfq_alloc_update(struct qfq_class *cl,
+						   u32 lmax, u32 inv_w,
+						   u32 xs_inv_w)
+{
+	struct qfq_cpu_work_entry *ent = kzalloc(sizeof(*ent), GFP_KERNEL);
+
+	if (ent == NULL)
+		return NULL;
+
+	ent->type = QFQ_WORK_UPDATE;
+	ent->cl = cl;
+	ent->lmax = lmax;
+	ent->inv_w = inv_w;
+	ent->xs_inv_w = xs_inv_w;
+	return ent;
+}
 
 /*
- * In principle
- *	q->bitmaps[dst] |= q->bitmaps[src] & mask;
- *	q->bitmaps[src] &= ~mask;
- * but we should make sure that src != dst
+ * Hand a list of work entries over to the spinner from the control path. All
+ * entries go to the same work queue, so the spinner processes them in a single
+ * pass.
  */
-static inline void qfq_move_groups(struct qfq_sched *q, unsigned long mask,
-				   int src, int dst)
+static void qfq_post_work(struct qfq_sched *q, struct list_head *work)
 {
-	q->bitmaps[dst] |= q->bitmaps[src] & mask;
-	q->bitmaps[src] &= ~mask;
-}
+	struct qfq_cpu_work_queue *work_queue;
+	struct qfq_cpu_work_entry *ent;
+	unsigned int cpu, n = 0;
+	u64 now;
 
-static void qfq_unblock_groups(struct qfq_sched *q, int index, u64 old_F)
-{
-	unsigned long mask = mask_from(q->bitmaps[ER], index + 1);
-	struct qfq_group *next;
+	if (list_empty(work))
+		return;
 
-	if (mask) {
-		next = qfq_ffs(q, mask);
-		if (!qfq_gt(next->F, old_F))
-			return;
+	now = qfq_now(q);
+	list_for_each_entry(ent, work, list) {
+		ent->time = now;
+		n++;
 	}
 
-	mask = (1UL << index) - 1;
-	qfq_move_groups(q, mask, EB, ER);
-	qfq_move_groups(q, mask, IB, IR);
+	cpu = get_cpu();
+	work_queue = per_cpu_ptr(q->work_queue, cpu);
+	spin_lock_bh(&work_queue->lock);
+	list_splice_tail_init(work, &work_queue->list);
+	work_queue->len += n;
+	spin_unlock_bh(&work_queue->lock);
+	set_bit(cpu, &q->work_bitmap);
+	put_cpu();
 }
 
-/*
- * perhaps
- *
-	old_V ^= q->V;
-	old_V >>= QFQ_MIN_SLOT_SHIFT;
-	if (old_V) {
-		...
-	}
- *
- */
-static void qfq_make_eligible(struct qfq_sched *q, u64 old_V)
+/* Remove work entries for a class that is going away. */
+static void qfq_flush_class_work(struct qfq_sched *q, struct qfq_class *cl)
 {
-	unsigned long vslot = q->V >> QFQ_MIN_SLOT_SHIFT;
-	unsigned long old_vslot = old_V >> QFQ_MIN_SLOT_SHIFT;
+	unsigned int cpu;
 
-	if (vslot != old_vslot) {
-		unsigned long mask = (1UL << fls(vslot ^ old_vslot)) - 1;
-		qfq_move_groups(q, mask, IR, ER);
-		qfq_move_groups(q, mask, IB, EB);
+	for_each_possible_cpu(cpu) {
+		struct qfq_cpu_work_queue *work_queue;
+		struct qfq_cpu_work_entry *ent, *tmp_ent;
+
+		work_queue = per_cpu_ptr(q->work_queue, cpu);
+		spin_lock_bh(&work_queue->lock);
+		list_for_each_entry_safe(ent, tmp_ent, &work_queue->list, list) {
+			if (ent->cl != cl)
+				continue;
+			list_del(&ent->list);
+			work_queue->len--;
+			kfree(ent);
+		}
+		spin_unlock_bh(&work_queue->lock);
 	}
 }
 
-
-/*
- * XXX we should make sure that slot becomes less than 32.
- * This is guaranteed by the input values.
- * roundedS is always cl->S rounded on grp->slot_shift bits.
- */
-static void qfq_slot_insert(struct qfq_sched *q,
-			    struct qfq_group *grp, struct qfq_class *cl,
-			    u64 roundedS)
+static void qfq_free_work(struct list_head *work)
 {
-	u64 slot = (roundedS - grp->S) >> grp->slot_shift;
-	unsigned int i = (grp->front + slot) % QFQ_MAX_SLOTS;
+	struct qfq_cpu_work_entry *ent, *tmp_ent;
 
-	if (unlikely(slot >= QFQ_MAX_SLOTS)) {
-		printk_ratelimited(KERN_INFO "[%s...%pS] slot %llu "
-				   "V=%llu "
-				   "cl->S=%llu "
-				   "roundedS=%llu "
-				   "grp->S=%llu "
-				   "grp->slot_shift=%u "
-				   "grp->full_slots=0x%lx "
-				   "grp->front=%u "
-				   "grp->idx=%u "
-				   "q->ER=0x%lx "
-				   "q->EB=0x%lx "
-				   "q->IR=0x%lx "
-				   "q->IB=0x%lx\n",
-				   __func__, __builtin_return_address(0),
-				   slot, q->V, cl->S, roundedS, grp->S,
-				   grp->slot_shift, grp->full_slots,
-				   grp->front, grp->index, q->bitmaps[ER],
-				   q->bitmaps[EB], q->bitmaps[IR],
-				   q->bitmaps[IB]);
-		slot = QFQ_MAX_SLOTS - 1;
-		i = (grp->front + slot) % QFQ_MAX_SLOTS;
+	list_for_each_entry_safe(ent, tmp_ent, work, list) {
+		list_del(&ent->list);
+		kfree(ent);
 	}
-	hlist_add_head(&cl->next, &grp->slots[i]);
-	__set_bit(slot, &grp->full_slots);
 }
 
-/* Maybe introduce hlist_first_entry?? */
-static struct qfq_class *qfq_slot_head(struct qfq_group *grp)
+static struct qfq_cpu_work_entry *qfq_alloc_remove(struct qfq_class *cl,
+						   gfp_t gfp)
 {
-	return hlist_entry(grp->slots[grp->front].first,
-			   struct qfq_class, next);
+	struct qfq_cpu_work_entry *ent = kzalloc(sizeof(*ent), gfp);
+
+	if (ent == NULL)
+		return NULL;
+
+	ent->type = QFQ_WORK_REMOVE;
+	ent->cl = cl;
+	return ent;
 }
 
-/*
- * remove the entry from the slot
- */
-static void qfq_front_slot_remove(struct qfq_group *grp)
+static void qfq_post_entry(struct qfq_sched *q, struct qfq_cpu_work_entry *ent)
 {
-	struct qfq_class *cl = qfq_slot_head(grp);
+	LIST_HEAD(work);
 
-	BUG_ON(!cl);
-	hlist_del(&cl->next);
-	if (hlist_empty(&grp->slots[grp->front]))
-		__clear_bit(0, &grp->full_slots);
+	list_add(&ent->list, &work);
+	qfq_post_work(q, &work);
 }
 
 /*
- * Returns the first full queue in a group. As a side effect,
- * adjust the bucket list so the first non-empty bucket is at
- * position 0 in full_slots.
+ * Take a purged class that the enqueue path can no longer find out of the
+ * scheduler, and wait until the spinner did so. It then holds no reference
+ * to the class anymore.
  */
-static struct qfq_class *qfq_slot_scan(struct qfq_group *grp)
+static void qfq_remove_class_sync(struct Qdisc *sch, struct qfq_class *cl)
 {
-	unsigned int i;
+	struct qfq_sched *q = qdisc_priv(sch);
+	DECLARE_COMPLETION_ONSTACK(done);
+	struct qfq_cpu_work_entry ent = {
+		.cl	= cl,
+		.type	= QFQ_WORK_REMOVE,
+		.done	= &done,
+	};
+
+	/* Without a spinner nothing else touches the scheduler */
+	if (IS_ERR(q->spinner)) {
+		qfq_spinner_remove_class(sch, cl);
+		return;
+	}
 
-	pr_debug("qfq slot_scan: grp %u full %#lx\n",
-		 grp->index, grp->full_slots);
+	qfq_post_entry(q, &ent);
+	wait_for_completion(&done);
+}
 
-	if (grp->full_slots == 0)
+static struct qfq_class *qfq_alloc_class(struct Qdisc *sch, u32 classid)
+{
+	struct qfq_sched *q = qdisc_priv(sch);
+	struct qfq_class *cl;
+
+	cl = kmem_cache_zalloc(qfq_class_cachep, GFP_KERNEL);
+	if (cl == NULL)
 		return NULL;
 
-	i = __ffs(grp->full_slots);  /* zero based */
-	if (i > 0) {
-		grp->front = (grp->front + i) % QFQ_MAX_SLOTS;
-		grp->full_slots >>= i;
+	cl->refcnt = 1;
+	cl->classid = classid;
+	cl->ent.cl = cl;
+	cl->xs.cl = cl;
+	qfq_set_ent_params(&q->excess, &cl->xs, 1UL << QFQ_MTU_SHIFT,
+			   ONE_FP + 1);
+
+	skb_queue_head_init(&cl->fifo);
+	if (light_classes) {
+		/* Same default limit as pfifo */
+		cl->limit = qdisc_dev(sch)->tx_queue_len ? : 1;
+	} else {
+		cl->qdisc = qdisc_create_dflt(sch->dev_queue,
+					      &pfifo_qdisc_ops, classid);
+		if (cl->qdisc == NULL)
+			cl->qdisc = &noop_qdisc;
 	}
+	qfq_map_attach(q, cl);
 
-	return qfq_slot_head(grp);
+	return cl;
 }
 
-/*
- * adjust the bucket list. When the start time of a group decreases,
- * we move the index down (modulo QFQ_MAX_SLOTS) so we don't need to
- * move the objects. The mask of occupied slots must be shifted
- * because we use ffs() to find the first non-empty slot.
- * This covers decreases in the group's start time, but what about
- * increases of the start time ?
- * Here too we should make sure that i is less than 32
- */
-static void qfq_slot_rotate(struct qfq_group *grp, u64 roundedS)
+static void qfq_free_class(struct Qdisc *sch, struct qfq_class *cl)
 {
-	unsigned int i = (grp->S - roundedS) >> grp->slot_shift;
-
-	grp->full_slots <<= i;
-	grp->front = (grp->front - i) % QFQ_MAX_SLOTS;
+	qfq_map_detach(qdisc_priv(sch), cl);
+	if (cl->qdisc)
+		qdisc_destroy(cl->qdisc);
+	kmem_cache_free(qfq_class_cachep, cl);
 }
 
-static void qfq_update_eligible(struct qfq_sched *q, u64 old_V)
+/* Validate a batch entry and convert it to (lmax, inv_w). */
+static int qfq_spec_params(struct Qdisc *sch,
+			   const struct tc_qfq_class_spec *spec,
+			   u32 *lmax, u32 *inv_w)
 {
-	unsigned long ineligible;
+	if (TC_H_MAJ(spec->classid ^ sch->handle) ||
+	    !TC_H_MIN(spec->classid)) {
+		pr_notice("qfq: invalid classid %x in batch\n", spec->classid);
+		return -EINVAL;
+	}
 
-	ineligible = q->bitmaps[IR] | q->bitmaps[IB];
-	if (ineligible) {
-		/*
-		 * For standard QFQ, we would first ensure V is not less
-		 * than the start time of the next ineligible group (work
-		 * conserving schedule) and update V if required.
-		 */
-		qfq_make_eligible(q, old_V);
+	if (spec->weight > (1UL << QFQ_MAX_WSHIFT)) {
+		pr_notice("qfq: invalid weight %u\n", spec->weight);
+		return -EINVAL;
+	}
+
+	if (spec->lmax > (1UL << QFQ_MTU_SHIFT)) {
+		pr_notice("qfq: invalid max length %u\n", spec->lmax);
+		return -EINVAL;
 	}
+
+	*inv_w = spec->weight ? ONE_FP / spec->weight : ONE_FP + 1;
+	*lmax = spec->lmax ? : 1UL << QFQ_MTU_SHIFT;
+	return 0;
+}
+
+static int qfq_cmp_u32(const void *a, const void *b)
+{
+	u32 x = *(const u32 *)a, y = *(const u32 *)b;
+
+	return x < y ? -1 : x > y;
 }
 
 /*
- * Updates the class, returns true if also the group needs to be updated.
+ * Create or update all classes listed in a TCA_QFQ_BATCH attribute. The
+ * class the request was sent for must be part of the batch. The batch is
+ * validated, all new classes are allocated and linked into a copy of the
+ * class table before anything is changed, so it is applied entirely or not
+ * at all. The copy is published under the tree lock along with the new
+ * configuration of existing classes, so lookups see either none or all of
+ * the batch. Changes to existing classes reach the spinner in a single list
+ * of work entries, which it processes in order.
  */
-static bool qfq_update_class(struct qfq_sched *q,
-			     struct qfq_group *grp, struct qfq_class *cl,
-			     unsigned int len)
+static int qfq_change_class_batch(struct Qdisc *sch, u32 classid,
+				  struct nlattr *attr, unsigned long *arg)
 {
-	/* We do not hold the class lock while updating class variables such as
-	 * S and F here. These variables are only updated from the dequeue
-	 * thread and the enqueue operation only makes changes to the class
-	 * qdisc.
-	 */
+	struct qfq_sched *q = qdisc_priv(sch);
+	const struct tc_qfq_class_spec *spec = nla_data(attr);
+	struct qfq_class_table *old, *new;
+	struct qfq_class **cls = NULL;
+	struct qfq_cpu_work_entry *ent;
+	LIST_HEAD(updates);
+	unsigned long *new_map = NULL;
+	u32 *ids = NULL;
+	unsigned int n, i, n_new = 0;
+	struct qfq_class *ret = NULL;
+	s64 delta_wsum = 0, delta_xs_wsum = 0;
+	u32 lmax, inv_w;
+	int err = -EINVAL;
+
+	if (nla_len(attr) % sizeof(*spec))
+		return -EINVAL;
+	n = nla_len(attr) / sizeof(*spec);
+	if (n == 0)
+		return -EINVAL;
 
-	cl->S = cl->F;
-	if (!len) {
-		qfq_front_slot_remove(grp);	/* queue is empty */
-		//cl->idle_on_deq++;
-	} else if (cl->inv_w == ONE_FP + 1) {
-		qfq_front_slot_remove(grp);	/* weight was changed to zero */
-	} else {
-		u64 roundedS;
+	cls = vzalloc(n * sizeof(*cls));
+	new_map = vzalloc(BITS_TO_LONGS(n) * sizeof(unsigned long));
+	ids = vmalloc(n * sizeof(*ids));
+	if (!cls || !new_map || !ids) {
+		err = -ENOMEM;
+		goto out;
+	}
 
-		cl->F = cl->S + (u64)len * cl->inv_w;
-		roundedS = qfq_round_down(cl->S, grp->slot_shift);
-		if (roundedS == grp->S)
-			return false;
+	/* Reject duplicate classids, they would be counted twice in wsum. */
+	for (i = 0; i < n; i++)
+		ids[i] = spec[i].classid;
+	sort(ids, n, sizeof(*ids), qfq_cmp_u32, NULL);
+	for (i = 1; i < n; i++) {
+		if (ids[i] == ids[i - 1]) {
+			pr_notice("qfq: duplicate classid %x in batch\n",
+				  ids[i]);
+			goto out;
+		}
+	}
 
-		qfq_front_slot_remove(grp);
-		qfq_slot_insert(q, grp, cl, roundedS);
+	for (i = 0; i < n; i++) {
+		err = qfq_spec_params(sch, &spec[i], &lmax, &inv_w);
+		if (err)
+			goto out;
+
+		cls[i] = qfq_find_class(sch, spec[i].classid);
+		if (cls[i] && cls[i]->prio) {
+			pr_notice("qfq: priority class %x in batch\n",
+				  spec[i].classid);
+			err = -EINVAL;
+			goto out;
+		}
+		if (cls[i] && cls[i]->ceil && ONE_FP / inv_w > cls[i]->ceil) {
+			pr_notice("qfq: weight of class %x above its ceiling\n",
+				  spec[i].classid);
+			err = -EINVAL;
+			goto out;
+		}
+		delta_wsum += (s64)(ONE_FP / inv_w) -
+			      (cls[i] ? ONE_FP / cls[i]->cfg_inv_w : 0);
+		/* New classes have no ceiling yet */
+		if (cls[i])
+			delta_xs_wsum +=
+				(s64)qfq_excess_w(inv_w, cls[i]->ceil) -
+				qfq_excess_w(cls[i]->cfg_inv_w, cls[i]->ceil);
+		if (spec[i].classid == classid)
+			ret = cls[i];
 	}
 
-	return true;
-}
+	err = -EINVAL;
+	if (q->wsum + delta_wsum > QFQ_MAX_WSUM) {
+		pr_notice("qfq: total weight out of range (%lld + %u)\n",
+			  delta_wsum, q->wsum);
+		goto out;
+	}
+	if (q->xs_wsum + delta_xs_wsum > QFQ_MAX_WSUM) {
+		pr_notice("qfq: total excess weight out of range (%lld + %u)\n",
+			  delta_xs_wsum, q->xs_wsum);
+		goto out;
+	}
 
-/* Update system time V */
-static void qfq_update_system_time(struct qfq_sched *q)
-{
-	u64 now;
-	u64 t_diff;
-	u64 v_diff = 0;
-	u64 old_V;
+	for (i = 0; i < n; i++) {
+		if (cls[i]) {
+			qfq_spec_params(sch, &spec[i], &lmax, &inv_w);
+			if (lmax == cls[i]->cfg_lmax &&
+			    inv_w == cls[i]->cfg_inv_w)
+				continue;
 
-	old_V = q->V;
-	now = ktime_get().tv64;
-	if (q->v_last_updated == now)
-		return;
+			ent = qfq_alloc_update(cls[i], lmax, inv_w,
+					       qfq_excess_inv_w(inv_w,
+								cls[i]->ceil));
+			if (ent == NULL) {
+				err = -ENOBUFS;
+				goto out_free_new;
+			}
+			list_add_tail(&ent->list, &updates);
+			continue;
+		}
 
-	t_diff = now - q->v_last_updated;
+		cls[i] = qfq_alloc_class(sch, spec[i].classid);
+		if (cls[i] == NULL) {
+			err = -ENOBUFS;
+			goto out_free_new;
+		}
+		__set_bit(i, new_map);
+		n_new++;
+		if (spec[i].classid == classid)
+			ret = cls[i];
+	}
 
-	/*
-	 * Increment V to account for transmission time of earlier dequeued
-	 * packets if required. Otherwise, just increment V based on the drain
-	 * rate of the link.
-	 */
-	if (q->t_diff_sum) {
-		if (t_diff >= q->t_diff_sum) {
-			v_diff = q->v_diff_sum;
-			t_diff -= q->t_diff_sum;
-			q->v_diff_sum = 0;
-			q->t_diff_sum = 0;
-			/* After accounting for all previously dequeued packets,
-			 * increment V at drain rate for remaining t_diff.
-			 * Only do this if there aren't any eligible and ready
-			 * groups currently. */
-			if (!q->bitmaps[ER])
-				v_diff += (u64)QFQ_DRAIN_RATE * t_diff / max((u32)LINK_SPEED, q->wsum_active);
+	if (ret == NULL) {
+		pr_notice("qfq: class %x is not part of the batch\n", classid);
+		goto out_free_new;
+	}
+
+	/* New classes go into a copy of the table, grown once to fit them */
+	old = qfq_table(q);
+	new = qfq_table_copy(q, max_t(unsigned int, old->size,
+				      roundup_pow_of_two(old->count + n_new)));
+	if (new == NULL) {
+		err = -ENOMEM;
+		goto out_free_new;
+	}
+
+	/* Nothing can fail from here on. */
+	sch_tree_lock(sch);
+	for (i = 0; i < n; i++) {
+		struct qfq_class *cl = cls[i];
+
+		qfq_spec_params(sch, &spec[i], &lmax, &inv_w);
+		if (test_bit(i, new_map)) {
+			qfq_update_class_params(q, cl, lmax, inv_w,
+						ONE_FP / inv_w);
+			qfq_set_class_cfg(q, cl, lmax, inv_w);
+			__qfq_table_insert(new, cl);
 		} else {
-			v_diff = q->v_diff_sum * t_diff / q->t_diff_sum;
-			q->v_diff_sum -= v_diff;
-			q->t_diff_sum -= t_diff;
+			q->wsum -= ONE_FP / cl->cfg_inv_w;
+			q->wsum += ONE_FP / inv_w;
+			q->xs_wsum -= qfq_excess_w(cl->cfg_inv_w, cl->ceil);
+			q->xs_wsum += qfq_excess_w(inv_w, cl->ceil);
+			qfq_set_class_cfg(q, cl, lmax, inv_w);
 		}
-	} else if (!q->bitmaps[ER]) {
-		/* Increment V at line rate if no group is eligible and ready */
-		v_diff = (u64)QFQ_DRAIN_RATE * t_diff / max((u32)LINK_SPEED, q->wsum_active);
 	}
+	rcu_assign_pointer(q->cltable, new);
+	sch_tree_unlock(sch);
+	qfq_post_work(q, &updates);
 
-	q->V += v_diff;
-	q->v_last_updated = now;
+	/* See qfq_table_rehash() */
+	synchronize_rcu_bh();
+	qfq_table_free(old);
 
-	/* Update group eligibility */
-	qfq_update_eligible(q, old_V);
+	*arg = (unsigned long)ret;
+	err = 0;
+	goto out;
+
+out_free_new:
+	qfq_free_work(&updates);
+	for (i = 0; i < n; i++) {
+		if (test_bit(i, new_map))
+			qfq_free_class(sch, cls[i]);
+	}
+out:
+	vfree(ids);
+	vfree(new_map);
+	vfree(cls);
+	return err;
 }
 
-static struct sk_buff *qfq_dummy_dequeue(struct Qdisc *sch)
+/*
+ * Class rates are estimated by the spinner from the packets it dequeues
+ * instead of by gen_estimator, whose timers take the root lock once per
+ * class and interval. TCA_RATE keeps its meaning: estimates are made every
+ * 2^(interval + 2) quarter seconds and averaged with weight 2^-ewma_log.
+ */
+static int qfq_est_config(struct qfq_sched *q, struct qfq_class *cl,
+			  struct nlattr *opt)
 {
-	qdisc_throttled(sch);
-	return NULL;
+	struct tc_estimator *parm = nla_data(opt);
+	spinlock_t *lock = qfq_cl_lock(cl);
+
+	if (nla_len(opt) < sizeof(*parm))
+		return -EINVAL;
+	if (parm->interval < -2 || parm->interval > 3 || parm->ewma_log >= 32)
+		return -EINVAL;
+
+	/* The first estimate covers the time from here on */
+	spin_lock_bh(lock);
+	cl->est_ewma_log = parm->ewma_log;
+	cl->est_interval = ((u64)NSEC_PER_SEC / 4) << (parm->interval + 2);
+	cl->est_last = qfq_now(q);
+	cl->est_bytes = 0;
+	cl->est_packets = 0;
+	spin_unlock_bh(lock);
+	return 0;
 }
 
-static struct sk_buff *qfq_dequeue(struct Qdisc *sch)
+/*
+ * Intervals without packets among the elapsed ns since the last estimate,
+ * all but the last one. Far beyond what a useful EWMA keeps, it is capped.
+ */
+static inline u64 qfq_est_idle_steps(const struct qfq_class *cl, u64 elapsed)
 {
-	struct qfq_sched *q = qdisc_priv(sch);
-	struct qfq_group *grp;
-	struct qfq_class *cl;
-	struct sk_buff *skb;
-	unsigned int len;
-	unsigned int next_len = 0;
-	int cl_qlen;
-	spinlock_t *class_lock;
-	u64 old_V;
+	u64 steps = min_t(u64, div64_u64(elapsed, cl->est_interval), 64);
 
-	/* Update system time V */
-	qfq_update_system_time(q);
-	if (!q->bitmaps[ER])
-		return NULL;
-
-	grp = qfq_ffs(q, q->bitmaps[ER]);
+	return steps ? steps - 1 : 0;
+}
 
-	cl = qfq_slot_head(grp);
-	class_lock = qdisc_lock(cl->qdisc);
-	spin_lock(class_lock);
-	skb = qdisc_dequeue_peeked(cl->qdisc);
-	cl_qlen = qdisc_qlen(cl->qdisc);
-	if (skb && cl_qlen) {
-//		s64 now = ktime_get().tv64;
-//		s64 dt = now - cl->prev_dequeue_time_ns;
-//		s64 dev = dt - cl->expected_inter_dequeue_time_ns;
-//		if (dev < 0) dev = -dev;
-//		cl->prev_dequeue_time_ns = now;
-//		/* Calculate EWMA */
-//		cl->inter_dequeue_time_ns = ((cl->inter_dequeue_time_ns * 7) + dt) >> 3;
-//		cl->absdev_dequeue_time_ns = ((cl->absdev_dequeue_time_ns * 7) + dev) >> 3;
-		next_len = qdisc_peek_len(cl->qdisc);
+/* Fold steps estimates of rate zero into an EWMA */
+static inline void qfq_est_decay(const struct qfq_class *cl, u64 *bps,
+				 u64 *pps, u64 steps)
+{
+	while (steps--) {
+		*bps -= *bps >> cl->est_ewma_log;
+		*pps -= *pps >> cl->est_ewma_log;
 	}
-	spin_unlock(class_lock);
+}
 
-	if (!skb) {
-		WARN_ONCE(1, "qfq_dequeue: non-workconserving leaf\n");
-		return NULL;
-	}
+/*
+ * The priority class takes the TCA_QFQ_PRIO_* attributes instead of a
+ * weight. It is never activated in the groups, like a class of weight zero,
+ * and the spinner serves it ahead of them from its own token bucket.
+ * qfq_prio_config() only checks them; qfq_change_class() applies them with
+ * qfq_prio_set() once nothing else can fail.
+ */
+#define QFQ_PRIO_BURST		16384
 
-	/* sch->q.qlen for the QFQ-RL qdisc now denotes the number of activated
-	 * classes. This value is only updated in the dequeue thread.
+static int qfq_prio_config(struct Qdisc *sch, struct qfq_class *cl,
+			   struct nlattr **tb, u32 *prate, u32 *pburst)
+{
+	struct qfq_sched *q = qdisc_priv(sch);
+	u32 rate = q->prio_rate, burst = q->prio_burst ? : QFQ_PRIO_BURST;
+	struct qfq_class *prio_cl = rtnl_dereference(q->prio_cl);
+
+	if (prio_cl && prio_cl != cl) {
+		pr_notice("qfq: class %x already has priority\n",
+			  prio_cl->classid);
+		return -EBUSY;
+	}
+
+	if (tb[TCA_QFQ_PRIO_RATE])
+		rate = nla_get_u32(tb[TCA_QFQ_PRIO_RATE]);
+	if (tb[TCA_QFQ_PRIO_BURST])
+		burst = nla_get_u32(tb[TCA_QFQ_PRIO_BURST]);
+	if (!rate || rate > q->link_speed || !burst) {
+		pr_notice("qfq: invalid priority rate %u burst %u\n",
+			  rate, burst);
+		return -EINVAL;
+	}
+
+	*prate = rate;
+	*pburst = burst;
+	return 0;
+}
+
+static void qfq_prio_set(struct qfq_sched *q, u32 rate, u32 burst)
+{
+	/* Read by the spinner without synchronization */
+	q->prio_rate = rate;
+	q->prio_burst = burst;
+}
+
+static int qfq_change_class(struct Qdisc *sch, u32 classid, u32 parentid,
+			    struct nlattr **tca, unsigned long *arg)
+{
+	struct qfq_sched *q = qdisc_priv(sch);
+	struct qfq_class *cl = (struct qfq_class *)*arg;
+	struct nlattr *tb[TCA_QFQ_MAX + 1];
+	struct qfq_cpu_work_entry *ent;
+	LIST_HEAD(work);
+	u32 weight, lmax, inv_w;
+	u32 ceil = 0;
+	u32 ecn_thresh = 0;
+	u32 prio_rate = 0, prio_burst = 0;
+	u64 ecn_target = 0;
+	bool prio;
+	int err;
+	int delta_w, delta_xs_w;
+
+	if (tca[TCA_OPTIONS] == NULL) {
+		pr_notice("qfq: no options\n");
+		return -EINVAL;
+	}
+
+	err = nla_parse_nested(tb, TCA_QFQ_MAX, tca[TCA_OPTIONS], qfq_policy);
+	if (err < 0)
+		return err;
+
+	if (tb[TCA_QFQ_BATCH])
+		return qfq_change_class_batch(sch, classid, tb[TCA_QFQ_BATCH],
+					      arg);
+
+	/* Missing attributes of the priority class keep their settings */
+	prio = tb[TCA_QFQ_PRIO_RATE] || tb[TCA_QFQ_PRIO_BURST];
+	if (cl != NULL) {
+		if (prio && !cl->prio) {
+			pr_notice("qfq: priority is set at class creation\n");
+			return -EINVAL;
+		}
+		prio = cl->prio;
+	}
+	if (prio) {
+		err = qfq_prio_config(sch, cl, tb, &prio_rate, &prio_burst);
+		if (err)
+			return err;
+	}
+
+	if (tb[TCA_QFQ_WEIGHT]) {
+		weight = nla_get_u32(tb[TCA_QFQ_WEIGHT]);
+		if (weight > (1UL << QFQ_MAX_WSHIFT)) {
+			pr_notice("qfq: invalid weight %u\n", weight);
+			return -EINVAL;
+		}
+	} else
+		weight = 1;
+	if (prio)
+		weight = 0;
+
+	inv_w = weight ? ONE_FP / weight : ONE_FP + 1;
+	weight = ONE_FP / inv_w;
+	delta_w = weight - (cl ? ONE_FP / cl->cfg_inv_w : 0);
+	if (q->wsum + delta_w > QFQ_MAX_WSUM) {
+		pr_notice("qfq: total weight out of range (%u + %u)\n",
+			  delta_w, q->wsum);
+		return -EINVAL;
+	}
+
+	if (tb[TCA_QFQ_CEIL]) {
+		ceil = nla_get_u32(tb[TCA_QFQ_CEIL]);
+		if ((ceil && (prio || ceil < weight)) ||
+		    ceil > (1UL << QFQ_MAX_WSHIFT)) {
+			pr_notice("qfq: invalid ceiling %u\n", ceil);
+			return -EINVAL;
+		}
+	}
+
+	/* The excess tier is bounded like the guaranteed one */
+	delta_xs_w = qfq_excess_w(inv_w, ceil) -
+		     (cl ? qfq_excess_w(cl->cfg_inv_w, cl->ceil) : 0);
+	if (q->xs_wsum + delta_xs_w > QFQ_MAX_WSUM) {
+		pr_notice("qfq: total excess weight out of range (%d + %u)\n",
+			  delta_xs_w, q->xs_wsum);
+		return -EINVAL;
+	}
+
+	if (tb[TCA_QFQ_LMAX]) {
+		lmax = nla_get_u32(tb[TCA_QFQ_LMAX]);
+		if (!lmax || lmax > (1UL << QFQ_MTU_SHIFT)) {
+			pr_notice("qfq: invalid max length %u\n", lmax);
+			return -EINVAL;
+		}
+	} else
+		lmax = 1UL << QFQ_MTU_SHIFT;
+
+	if (tb[TCA_QFQ_ECN_THRESH])
+		ecn_thresh = nla_get_u32(tb[TCA_QFQ_ECN_THRESH]);
+	if (tb[TCA_QFQ_ECN_TARGET])
+		ecn_target = (u64)nla_get_u32(tb[TCA_QFQ_ECN_TARGET]) *
+			     NSEC_PER_USEC;
+
+	if (cl != NULL) {
+		/* The spinner applies the new parameters at its next pass. */
+		if (lmax != cl->cfg_lmax || inv_w != cl->cfg_inv_w ||
+		    ceil != cl->ceil) {
+			ent = qfq_alloc_update(cl, lmax, inv_w,
+					       qfq_excess_inv_w(inv_w, ceil));
+			if (ent == NULL)
+				return -ENOBUFS;
+			list_add_tail(&ent->list, &work);
+		}
+
+		if (tca[TCA_RATE]) {
+			err = qfq_est_config(q, cl, tca[TCA_RATE]);
+			if (err) {
+				qfq_free_work(&work);
+				return err;
+			}
+		}
+
+		/* Read by the spinner on every dequeue, no ordering needed */
+		cl->ecn_thresh = ecn_thresh;
+		cl->ecn_target = ecn_target;
+		if (ecn_target && !qfq_cl_stamped(cl))
+			pr_notice("qfq: ECN target of class %x needs a fifo\n",
+				  cl->classid);
+		if (cl->prio) {	/* The priority rate may have changed */
+			qfq_prio_set(q, prio_rate, prio_burst);
+			qfq_set_class_cfg(q, cl, cl->cfg_lmax, cl->cfg_inv_w);
+		}
+
+		if (list_empty(&work))
+			return 0; /* nothing to update */
+
+		q->wsum += delta_w;
+		q->xs_wsum += delta_xs_w;
+		cl->ceil = ceil;
+		qfq_set_class_cfg(q, cl, lmax, inv_w);
+		qfq_post_work(q, &work);
+
+		return 0;
+	}
+
+	cl = qfq_alloc_class(sch, classid);
+	if (cl == NULL)
+		return -ENOBUFS;
+
+	if (tca[TCA_RATE]) {
+		err = qfq_est_config(q, cl, tca[TCA_RATE]);
+		if (err) {
+			qfq_free_class(sch, cl);
+			return err;
+		}
+	}
+
+	cl->prio = prio;
+	if (prio)
+		qfq_prio_set(q, prio_rate, prio_burst);
+	qfq_update_class_params(q, cl, lmax, inv_w, delta_w);
+	qfq_set_class_cfg(q, cl, lmax, inv_w);
+	cl->ceil = ceil;
+	q->xs_wsum += delta_xs_w;
+	qfq_set_ent_params(&q->excess, &cl->xs, lmax,
+			   qfq_excess_inv_w(inv_w, ceil));
+	cl->ecn_thresh = ecn_thresh;
+	cl->ecn_target = ecn_target;
+	if (prio) {
+		q->prio_tokens = 0;
+		rcu_assign_pointer(q->prio_cl, cl);
+	}
+
+//	cl->prev_dequeue_time_ns = ktime_get().tv64;
+//	cl->inter_dequeue_time_ns = 0;
+//
+//	cl->expected_inter_dequeue_time_ns = 1482LLU * 8 * 1000 / weight;
+//	cl->absdev_dequeue_time_ns = 0;
+
+	qfq_table_insert(q, cl);
+
+	*arg = (unsigned long)cl;
+	return 0;
+}
+
+static void qfq_free_class_rcu(struct rcu_head *head)
+{
+	kmem_cache_free(qfq_class_cachep,
+			container_of(head, struct qfq_class, rcu));
+}
+
+static void qfq_destroy_class(struct Qdisc *sch, struct qfq_class *cl)
+{
+	struct qfq_sched *q = qdisc_priv(sch);
+
+	/* The spinner took the class out of the tiers, or is stopped */
+	if (cl->ent.inv_w) {
+		q->wsum -= ONE_FP / cl->cfg_inv_w;
+		q->xs_wsum -= qfq_excess_w(cl->cfg_inv_w, cl->ceil);
+		cl->ent.inv_w = 0;
+	}
+
+	qfq_map_detach(q, cl);
+	qfq_drop_unlist(q, cl);
+	if (cl->qdisc)
+		qdisc_destroy(cl->qdisc);
+	else
+		qfq_cl_reset(cl);
+
+	/* Lockless lookups may still see the class */
+	call_rcu_bh(&cl->rcu, qfq_free_class_rcu);
+}
+
+static int qfq_delete_class(struct Qdisc *sch, unsigned long arg)
+{
+	struct qfq_sched *q = qdisc_priv(sch);
+	struct qfq_class *cl = (struct qfq_class *)arg;
+
+	if (cl->filter_cnt > 0)
+		return -EBUSY;
+
+	sch_tree_lock(sch);
+
+	/* The spinner holds on to it for an RCU-bh read side section */
+	if (cl->prio)
+		RCU_INIT_POINTER(q->prio_cl, NULL);
+	qfq_table_remove(q, cl);
+
+	BUG_ON(--cl->refcnt == 0);
+	/*
+	 * This shouldn't happen: we "hold" one cops->get() when called
+	 * from tc_ctl_tclass; the destroy method is done from cops->put().
+	 */
+
+	sch_tree_unlock(sch);
+
+	/* Enqueues that still found the class drop their packets from here
+	 * on, and queue no more work for it; see qfq_enqueue(). The class
+	 * itself is freed only after an RCU-bh grace period.
+	 */
+	spin_lock_bh(qfq_cl_lock(cl));
+	cl->dead = true;
+	spin_unlock_bh(qfq_cl_lock(cl));
+
+	qfq_purge_queue(q, cl);
+	qfq_flush_class_work(q, cl);
+	qfq_remove_class_sync(sch, cl);
+	return 0;
+}
+
+static unsigned long qfq_get_class(struct Qdisc *sch, u32 classid)
+{
+	struct qfq_class *cl = qfq_find_class(sch, classid);
+
+	if (cl != NULL)
+		cl->refcnt++;
+
+	return (unsigned long)cl;
+}
+
+static void qfq_put_class(struct Qdisc *sch, unsigned long arg)
+{
+	struct qfq_class *cl = (struct qfq_class *)arg;
+
+	if (--cl->refcnt == 0)
+		qfq_destroy_class(sch, cl);
+}
+
+static struct tcf_proto **qfq_tcf_chain(struct Qdisc *sch, unsigned long cl)
+{
+	struct qfq_sched *q = qdisc_priv(sch);
+
+	if (cl)
+		return NULL;
+
+	return &q->filter_list;
+}
+
+static unsigned long qfq_bind_tcf(struct Qdisc *sch, unsigned long parent,
+				  u32 classid)
+{
+	struct qfq_class *cl = qfq_find_class(sch, classid);
+
+	if (cl != NULL)
+		cl->filter_cnt++;
+
+	return (unsigned long)cl;
+}
+
+static void qfq_unbind_tcf(struct Qdisc *sch, unsigned long arg)
+{
+	struct qfq_class *cl = (struct qfq_class *)arg;
+
+	cl->filter_cnt--;
+}
+
+static int qfq_graft_class(struct Qdisc *sch, unsigned long arg,
+			   struct Qdisc *new, struct Qdisc **old)
+{
+	struct qfq_sched *q = qdisc_priv(sch);
+	struct qfq_class *cl = (struct qfq_class *)arg;
+	struct qfq_cpu_work_entry *ent;
+
+	if (new == NULL) {
+		new = qdisc_create_dflt(sch->dev_queue,
+					&pfifo_qdisc_ops, cl->classid);
+		if (new == NULL)
+			new = &noop_qdisc;
+	}
+
+	/* Without it the dequeue path drops the class once it reaches it */
+	ent = qfq_alloc_remove(cl, GFP_KERNEL);
+
+	sch_tree_lock(sch);
+	qfq_purge_queue(q, cl);
+	*old = cl->qdisc;
+	cl->qdisc = new;
+	sch_tree_unlock(sch);
+
+	if (ent)
+		qfq_post_entry(q, ent);
+	return 0;
+}
+
+static struct Qdisc *qfq_class_leaf(struct Qdisc *sch, unsigned long arg)
+{
+	struct qfq_class *cl = (struct qfq_class *)arg;
+
+	return cl->qdisc;
+}
+
+static int qfq_dump_class(struct Qdisc *sch, unsigned long arg,
+			  struct sk_buff *skb, struct tcmsg *tcm)
+{
+	struct qfq_sched *q = qdisc_priv(sch);
+	struct qfq_class *cl = (struct qfq_class *)arg;
+	struct nlattr *nest;
+
+	tcm->tcm_parent	= TC_H_ROOT;
+	tcm->tcm_handle	= cl->classid;
+	tcm->tcm_info	= cl->qdisc ? cl->qdisc->handle : 0;
+
+	nest = nla_nest_start(skb, TCA_OPTIONS);
+	if (nest == NULL)
+		goto nla_put_failure;
+	if (nla_put_u32(skb, TCA_QFQ_WEIGHT, ONE_FP/cl->cfg_inv_w) ||
+	    nla_put_u32(skb, TCA_QFQ_LMAX, cl->cfg_lmax))
+		goto nla_put_failure;
+	if (cl->ecn_thresh &&
+	    nla_put_u32(skb, TCA_QFQ_ECN_THRESH, cl->ecn_thresh))
+		goto nla_put_failure;
+	if (cl->ecn_target &&
+	    nla_put_u32(skb, TCA_QFQ_ECN_TARGET,
+			div_u64(cl->ecn_target, NSEC_PER_USEC)))
+		goto nla_put_failure;
+	if (cl->ceil && nla_put_u32(skb, TCA_QFQ_CEIL, cl->ceil))
+		goto nla_put_failure;
+	if (cl->prio &&
+	    (nla_put_u32(skb, TCA_QFQ_PRIO_RATE, q->prio_rate) ||
+	     nla_put_u32(skb, TCA_QFQ_PRIO_BURST, q->prio_burst)))
+		goto nla_put_failure;
+
+	return nla_nest_end(skb, nest);
+
+nla_put_failure:
+	nla_nest_cancel(skb, nest);
+	return -EMSGSIZE;
+}
+
+/*
+ * Rate estimate of a class for dumping. The spinner only updates it when the
+ * class sends, so the estimate of a class that went idle is decayed here by
+ * one step for every interval it has been idle.
+ */
+static void qfq_est_read(struct qfq_sched *q, struct qfq_class *cl,
+			 struct gnet_stats_rate_est *rate_est)
+{
+	u64 bps = cl->est_bps, pps = cl->est_pps;
+	u64 idle;
+
+	memset(rate_est, 0, sizeof(*rate_est));
+	if (!cl->est_interval)
+		return;
+
+	idle = qfq_now(q) - cl->est_last;
+	if ((s64)idle > 0)
+		qfq_est_decay(cl, &bps, &pps, qfq_est_idle_steps(cl, idle));
+
+	rate_est->bps = min_t(u64, (bps + 0x1F) >> 5, U32_MAX);
+	rate_est->pps = min_t(u64, (pps + 0x1F) >> 5, U32_MAX);
+}
+
+static s64 qfq_lag_read(const struct qfq_class *cl, u64 now);
+
+static int qfq_dump_class_stats(struct Qdisc *sch, unsigned long arg,
+				struct gnet_dump *d)
+{
+	struct qfq_class *cl = (struct qfq_class *)arg;
+	struct tc_qfq_xstats xstats = {.type = TCA_QFQ_XSTATS_CLASS};
+	struct gnet_stats_rate_est rate_est;
+	struct gnet_stats_queue qstats;
+
+//	xstats.class_stats.idle_on_deq = cl->idle_on_deq;
+//	xstats.class_stats.inter_deq_time_ns = cl->inter_dequeue_time_ns;
+//	xstats.class_stats.absdev_deq_time_ns = cl->absdev_dequeue_time_ns;
+//	xstats.class_stats.expected_inter_dequeue_time_ns = cl->expected_inter_dequeue_time_ns;
+	xstats.class_stats.ecn_mark = cl->ecn_mark;
+	xstats.class_stats.lag = qfq_lag_read(cl, qfq_now(qdisc_priv(sch)));
+	xstats.class_stats.lag_max = cl->lag_max;
+	xstats.class_stats.excess_packets = cl->excess_packets;
+
+	qfq_est_read(qdisc_priv(sch), cl, &rate_est);
+
+	/* A child qdisc counts its own drops, but not the ones made before
+	 * packets reach it.
+	 */
+	qstats = cl->qstats;
+	if (cl->qdisc) {
+		qstats = cl->qdisc->qstats;
+		qstats.drops += cl->qstats.drops;
+	}
+	qstats.qlen = qfq_cl_qlen(cl);
+	//printk(KERN_INFO "class %p inter_dequeue_time %lld\n", cl, cl->inter_dequeue_time_ns);
+
+	if (gnet_stats_copy_basic(d, &cl->bstats) < 0 ||
+	    gnet_stats_copy_rate_est(d, NULL, &rate_est) < 0 ||
+	    gnet_stats_copy_queue(d, &qstats) < 0)
+		return -1;
+
+	return gnet_stats_copy_app(d, &xstats, sizeof(xstats));
+}
+
+static void qfq_walk(struct Qdisc *sch, struct qdisc_walker *arg)
+{
+	struct qfq_sched *q = qdisc_priv(sch);
+	struct qfq_class_table *t = qfq_table(q);
+	struct qfq_class *cl;
+	unsigned int i;
+
+	if (arg->stop)
+		return;
+
+	for (i = 0; i < t->size; i++) {
+		hlist_for_each_entry(cl, &t->buckets[i], hnode[t->node_ver]) {
+			if (arg->count < arg->skip) {
+				arg->count++;
+				continue;
+			}
+			if (arg->fn(sch, (unsigned long)cl, arg) < 0) {
+				arg->stop = 1;
+				return;
+			}
+			arg->count++;
+		}
+	}
+}
+
+static struct qfq_class *qfq_classify(struct sk_buff *skb, struct Qdisc *sch,
+				      int *qerr)
+{
+	struct qfq_sched *q = qdisc_priv(sch);
+	struct qfq_class *cl;
+	struct tcf_result res;
+	int result;
+
+	if (likely(skb->sk && skb->sk->qdisc_cache == sch && skb->sk->cl_cache)) {
+		cl = skb->sk->cl_cache;
+		if (likely(!ACCESS_ONCE(cl->dead)))
+			return cl;
+	}
+
+	if (TC_H_MAJ(skb->priority ^ sch->handle) == 0) {
+		pr_debug("qfq_classify: found %d\n", skb->priority);
+		cl = qfq_find_class(sch, skb->priority);
+		if (cl != NULL)
+			return cl;
+	}
+
+	*qerr = NET_XMIT_SUCCESS | __NET_XMIT_BYPASS;
+	result = tc_classify(skb, q->filter_list, &res);
+	if (result >= 0) {
+#ifdef CONFIG_NET_CLS_ACT
+		switch (result) {
+		case TC_ACT_QUEUED:
+		case TC_ACT_STOLEN:
+			*qerr = NET_XMIT_SUCCESS | __NET_XMIT_STOLEN;
+		case TC_ACT_SHOT:
+			return NULL;
+		}
+#endif
+		cl = (struct qfq_class *)res.class;
+		if (cl == NULL)
+			cl = qfq_find_class(sch, res.classid);
+		return cl;
+	}
+
+	return NULL;
+}
+
+/* Generic comparison function, handling wraparound. */
+static inline int qfq_gt(u64 a, u64 b)
+{
+	return (s64)(a - b) > 0;
+}
+
+/* Round a precise timestamp to its slotted value. */
+static inline u64 qfq_round_down(u64 ts, unsigned int shift)
+{
+	return ts & ~((1ULL << shift) - 1);
+}
+
+/* return the pointer to the group with lowest index in the bitmap */
+static inline struct qfq_group *qfq_ffs(struct qfq_tier *t,
+					unsigned long bitmap)
+{
+	int index = __ffs(bitmap);
+	return &t->groups[index];
+}
+/* Calculate a mask to mimic what would be ffs_from(). */
+static inline unsigned long mask_from(unsigned long bitmap, int from)
+{
+	return bitmap & ~((1UL << from) - 1);
+}
+
+/*
+ * The state computation relies on ER=0, IR=1, EB=2, IB=3
+ * First compute eligibility comparing grp->S, t->V,
+ * then check if someone is blocking us and possibly add EB
+ */
+static int qfq_calc_state(struct qfq_tier *t, const struct qfq_group *grp)
+{
+	/* if S > V we are not eligible */
+	unsigned int state = qfq_gt(grp->S, t->V);
+	unsigned long mask = mask_from(t->bitmaps[ER], grp->index);
+	struct qfq_group *next;
+
+	if (mask) {
+		next = qfq_ffs(t, mask);
+		if (qfq_gt(grp->F, next->F))
+			state |= EB;
+	}
+
+	return state;
+}
+
+
+/*
+ * In principle
+ *	t->bitmaps[dst] |= t->bitmaps[src] & mask;
+ *	t->bitmaps[src] &= ~mask;
+ * but we should make sure that src != dst
+ */
+static inline void qfq_move_groups(struct qfq_tier *t, unsigned long mask,
+				   int src, int dst)
+{
+	t->bitmaps[dst] |= t->bitmaps[src] & mask;
+	t->bitmaps[src] &= ~mask;
+}
+
+static void qfq_unblock_groups(struct qfq_tier *t, int index, u64 old_F)
+{
+	unsigned long mask = mask_from(t->bitmaps[ER], index + 1);
+	unsigned long below;
+	struct qfq_group *next;
+
+	if (mask) {
+		next = qfq_ffs(t, mask);
+		if (!qfq_gt(next->F, old_F))
+			return;
+	}
+
+	mask = (1UL << index) - 1;
+	/*
+	 * If a lower ER group was skipped because its transmit queue stalled,
+	 * the groups below it may still be blocked by it.
+	 */
+	below = t->bitmaps[ER] & mask;
+	if (below)
+		mask &= ~((2UL << __fls(below)) - 1);
+	qfq_move_groups(t, mask, EB, ER);
+	qfq_move_groups(t, mask, IB, IR);
+}
+
+/*
+ * perhaps
+ *
+	old_V ^= t->V;
+	old_V >>= QFQ_MIN_SLOT_SHIFT;
+	if (old_V) {
+		...
+	}
+ *
+ */
+static void qfq_make_eligible(struct qfq_tier *t, u64 old_V)
+{
+	unsigned long vslot = t->V >> QFQ_MIN_SLOT_SHIFT;
+	unsigned long old_vslot = old_V >> QFQ_MIN_SLOT_SHIFT;
+
+	if (vslot != old_vslot) {
+		unsigned long mask = (1UL << fls(vslot ^ old_vslot)) - 1;
+		qfq_move_groups(t, mask, IR, ER);
+		qfq_move_groups(t, mask, IB, EB);
+	}
+}
+
+
+/*
+ * XXX we should make sure that slot becomes less than 32.
+ * This is guaranteed by the input values.
+ * roundedS is always e->S rounded on grp->slot_shift bits.
+ */
+static void qfq_slot_insert(struct qfq_tier *t,
+			    struct qfq_group *grp, struct qfq_entity *e,
+			    u64 roundedS)
+{
+	u64 slot = (roundedS - grp->S) >> grp->slot_shift;
+	unsigned int i = (grp->front + slot) % QFQ_MAX_SLOTS;
+
+	if (unlikely(slot >= QFQ_MAX_SLOTS)) {
+		printk_ratelimited(KERN_INFO "[%s...%pS] slot %llu "
+				   "V=%llu "
+				   "e->S=%llu "
+				   "roundedS=%llu "
+				   "grp->S=%llu "
+				   "grp->slot_shift=%u "
+				   "grp->full_slots=0x%lx "
+				   "grp->front=%u "
+				   "grp->idx=%u "
+				   "t->ER=0x%lx "
+				   "t->EB=0x%lx "
+				   "t->IR=0x%lx "
+				   "t->IB=0x%lx\n",
+				   __func__, __builtin_return_address(0),
+				   slot, t->V, e->S, roundedS, grp->S,
+				   grp->slot_shift, grp->full_slots,
+				   grp->front, grp->index, t->bitmaps[ER],
+				   t->bitmaps[EB], t->bitmaps[IR],
+				   t->bitmaps[IB]);
+		slot = QFQ_MAX_SLOTS - 1;
+		i = (grp->front + slot) % QFQ_MAX_SLOTS;
+	}
+	hlist_add_head(&e->next, &grp->slots[i]);
+	__set_bit(slot, &grp->full_slots);
+}
+
+/* Maybe introduce hlist_first_entry?? */
+static struct qfq_entity *qfq_slot_head(struct qfq_group *grp)
+{
+	return hlist_entry(grp->slots[grp->front].first,
+			   struct qfq_entity, next);
+}
+
+/*
+ * remove the entry from the slot
+ */
+static void qfq_front_slot_remove(struct qfq_group *grp)
+{
+	struct qfq_entity *e = qfq_slot_head(grp);
+
+	BUG_ON(!e);
+	hlist_del_init(&e->next);
+	if (hlist_empty(&grp->slots[grp->front]))
+		__clear_bit(0, &grp->full_slots);
+}
+
+/*
+ * Returns the first full queue in a group. As a side effect,
+ * adjust the bucket list so the first non-empty bucket is at
+ * position 0 in full_slots.
+ */
+static struct qfq_entity *qfq_slot_scan(struct qfq_group *grp)
+{
+	unsigned int i;
+
+	pr_debug("qfq slot_scan: grp %u full %#lx\n",
+		 grp->index, grp->full_slots);
+
+	if (grp->full_slots == 0)
+		return NULL;
+
+	i = __ffs(grp->full_slots);  /* zero based */
+	if (i > 0) {
+		grp->front = (grp->front + i) % QFQ_MAX_SLOTS;
+		grp->full_slots >>= i;
+	}
+
+	return qfq_slot_head(grp);
+}
+
+/*
+ * adjust the bucket list. When the start time of a group decreases,
+ * we move the index down (modulo QFQ_MAX_SLOTS) so we don't need to
+ * move the objects. The mask of occupied slots must be shifted
+ * because we use ffs() to find the first non-empty slot.
+ * This covers decreases in the group's start time, but what about
+ * increases of the start time ?
+ * Here too we should make sure that i is less than 32
+ */
+static void qfq_slot_rotate(struct qfq_group *grp, u64 roundedS)
+{
+	unsigned int i = (grp->S - roundedS) >> grp->slot_shift;
+
+	grp->full_slots <<= i;
+	grp->front = (grp->front - i) % QFQ_MAX_SLOTS;
+}
+
+static void qfq_update_eligible(struct qfq_tier *t, u64 old_V)
+{
+	unsigned long ineligible;
+
+	ineligible = t->bitmaps[IR] | t->bitmaps[IB];
+	if (ineligible) {
+		/*
+		 * For standard QFQ, we would first ensure V is not less
+		 * than the start time of the next ineligible group (work
+		 * conserving schedule) and update V if required.
+		 */
+		qfq_make_eligible(t, old_V);
+	}
+}
+
+/*
+ * Updates the class, returns true if also the group needs to be updated.
+ */
+static bool qfq_update_class(struct qfq_tier *t,
+			     struct qfq_group *grp, struct qfq_entity *e,
+			     unsigned int len)
+{
+	/* We do not hold the class lock while updating class variables such as
+	 * S and F here. These variables are only updated from the dequeue
+	 * thread and the enqueue operation only makes changes to the class
+	 * qdisc.
+	 */
+
+	e->S = e->F;
+	if (!len) {
+		qfq_front_slot_remove(grp);	/* queue is empty */
+		//e->cl->idle_on_deq++;
+	} else if (e->inv_w == ONE_FP + 1) {
+		qfq_front_slot_remove(grp);	/* weight was changed to zero */
+	} else {
+		u64 roundedS;
+
+		e->F = e->S + (u64)len * e->inv_w;
+		roundedS = qfq_round_down(e->S, grp->slot_shift);
+		if (roundedS == grp->S)
+			return false;
+
+		qfq_front_slot_remove(grp);
+		qfq_slot_insert(t, grp, e, roundedS);
+	}
+
+	return true;
+}
+
+/* Bytes due to a class over ns of service. A weight is a rate in Mbps. */
+static inline u64 qfq_lag_due(const struct qfq_class *cl, u64 ns)
+{
+	return qfq_mul_div(ns, ONE_FP, (u64)cl->ent.inv_w * 8000);
+}
+
+/*
+ * Lag of a backlogged class: bytes served since it was activated minus the
+ * bytes its rate entitled it to in that time. It is negative while the class
+ * is behind its rate. Read without synchronization with the spinner for the
+ * stats dump.
+ */
+static s64 qfq_lag_read(const struct qfq_class *cl, u64 now)
+{
+	u64 start = cl->lag_start;
+
+	if (!start || (s64)(now - start) <= 0)
+		return 0;
+	return (s64)cl->lag_served - (s64)qfq_lag_due(cl, now - start);
+}
+
+/*
+ * Account a dequeued packet in the lag of its class. The shortfall is
+ * largest right before a packet is served, so that is where it is sampled.
+ */
+static void qfq_lag_update(struct qfq_sched *q, struct qfq_class *cl,
+			   unsigned int len, u64 now)
+{
+	s64 lag = qfq_lag_read(cl, now);
+
+	if (lag < 0 && -lag > (s64)cl->lag_max) {
+		cl->lag_max = -lag;
+		if (cl->lag_max > q->lag_max)
+			q->lag_max = cl->lag_max;
+	}
+	cl->lag_served += len;
+}
+
+/*
+ * Per packet state kept in qdisc_skb_cb. A child qdisc may keep its own
+ * there, codel, fq_codel, sfb and choke do, so it only survives in classes
+ * without one or with a plain fifo, see qfq_cl_stamped().
+ */
+struct qfq_skb_cb {
+	u64 enqueue_time;	/* qfq_now() at enqueue, for ECN marking */
+};
+
+static inline struct qfq_skb_cb *qfq_skb_cb(struct sk_buff *skb)
+{
+	qdisc_cb_private_validate(skb, sizeof(struct qfq_skb_cb));
+	return (struct qfq_skb_cb *)qdisc_skb_cb(skb)->data;
+}
+
+/* Update system time V, returning the ns of the gap not credited to it */
+static u64 qfq_update_system_time(struct qfq_sched *q, struct qfq_tier *t,
+				  u64 now)
+{
+	u64 t_diff;
+	u64 v_diff;
+	u64 old_V;
+	u64 dropped;
+	int idle = !t->bitmaps[ER];
+
+	old_V = t->V;
+	if (t->v_last_updated == now)
+		return 0;
+
+	t_diff = now - t->v_last_updated;
+	dropped = qfq_v_credit(&t_diff, q->idle_credit, t->wsum_active);
+
+	/* Forwarded at the drain rate if nothing is eligible and ready */
+	if (idle && t_diff >= t->t_diff_sum)
+		q->v_forwarded++;
+	v_diff = qfq_v_advance(&t->v_diff_sum, &t->t_diff_sum, t_diff,
+			       idle || t == &q->excess, q->drain_rate,
+			       max(q->link_speed, t->wsum_active));
+	if (t == &q->excess && !idle)
+		v_diff = qfq_v_bound(t->V, v_diff,
+				     qfq_ffs(t, t->bitmaps[ER])->F);
+
+	t->V += v_diff;
+	t->v_last_updated = now;
+
+	/* Update group eligibility */
+	qfq_update_eligible(t, old_V);
+	return dropped;
+}
+
+/*
+ * Bring V of both tiers up to now. An empty excess tier has no use for V.
+ * Both tiers see the same gap, so a capped gap is counted once.
+ */
+static void qfq_update_tiers(struct qfq_sched *q, u64 now)
+{
+	u64 dropped, xs_dropped = 0;
+
+	dropped = qfq_update_system_time(q, &q->guar, now);
+	if (q->excess.wsum_active)
+		xs_dropped = qfq_update_system_time(q, &q->excess, now);
+	else
+		q->excess.v_last_updated = now;
+
+	dropped = max(dropped, xs_dropped);
+	if (dropped) {
+		q->credit_capped++;
+		q->credit_dropped += dropped;
+	}
+}
+
+static struct sk_buff *qfq_dummy_dequeue(struct Qdisc *sch)
+{
+	qdisc_throttled(sch);
+	return NULL;
+}
+
+/*
+ * Cycle accounting of the spinner phases. With profiling off this is a
+ * patched out branch; a phase that straddles switching it on is skipped.
+ */
+static inline cycles_t qfq_phase_start(void)
+{
+	if (static_key_false(&qfq_profile_key))
+		return get_cycles();
+	return 0;
+}
+
+static inline void qfq_phase_end(struct qfq_sched *q, enum qfq_phase phase,
+				 cycles_t start)
+{
+	struct qfq_phase_stats *ps = &q->phases[phase];
+	u64 cycles;
+
+	if (!static_key_false(&qfq_profile_key) || !start)
+		return;
+
+	cycles = get_cycles() - start;
+	ps->calls++;
+	ps->cycles += cycles;
+	if (cycles > ps->max)
+		ps->max = cycles;
+}
+
+/* Transmit queue a packet dequeued by the spinner will be sent on. */
+static u16 qfq_select_txq(struct qfq_sched *q, struct net_device *dev,
+			  struct qfq_class *cl, struct sk_buff *skb)
+{
+	/* The queue count may have been lowered since cl->txq was set */
+	if (q->txq_policy != QFQ_TXQ_HASH &&
+	    likely(cl->txq < dev->real_num_tx_queues))
+		return cl->txq;
+
+	/* Hash the skb on to one of the available queues */
+	return skb_tx_hash(dev, skb);
+}
+
+/*
+ * Whether a transmit queue can take another packet right now. Drivers that
+ * support Byte Queue Limits account the bytes we hand them in their
+ * ndo_start_xmit (netdev_tx_sent_queue) and stop the queue once the dql limit
+ * is reached. Checking before dequeueing keeps packets in the qdisc, where
+ * QFQ-RL paces them, rather than in the NIC ring.
+ */
+static inline bool qfq_txq_ready(struct qfq_sched *q, struct net_device *dev,
+				 u16 queue_index)
+{
+	struct netdev_queue *txq = netdev_get_tx_queue(dev, queue_index);
+
+	if (q->txqs[queue_index].parked || netif_xmit_frozen_or_stopped(txq))
+		return false;
+#ifdef CONFIG_BQL
+	if (dql_avail(&txq->dql) < 0)
+		return false;
+#endif
+	return true;
+}
+
+static inline void qfq_txq_stall(struct qfq_sched *q, u16 queue_index)
+{
+	struct qfq_txq *t = &q->txqs[queue_index];
+
+	if (!t->stalled) {
+		t->stalled = true;
+		t->stalls++;
+		q->txq_blocked++;
+	}
+}
+
+/*
+ * Find the entity of tier t to serve next. This is the head of the first ER
+ * group unless the packet at its head is bound for a transmit queue that
+ * cannot take it. In that case the following ER groups are tried in order, so
+ * a stalled queue holds up only the classes sending to it. Every ER group is
+ * eligible, so serving a later one still keeps S <= V. Returns with the lock
+ * of its class held, or NULL if no eligible head can be sent.
+ */
+static struct qfq_entity *qfq_pick_class(struct qfq_sched *q,
+					 struct qfq_tier *t,
+					 struct net_device *dev,
+					 u16 *queue_index)
+{
+	unsigned long mask = t->bitmaps[ER];
+	struct qfq_group *grp;
+	struct qfq_entity *e;
+	struct sk_buff *skb;
+	cycles_t c;
+
+	while (mask) {
+		grp = qfq_ffs(t, mask);
+		e = qfq_slot_head(grp);
+		spin_lock(qfq_cl_lock(e->cl));
+		skb = qfq_cl_peek(e->cl);
+		if (!skb)
+			return e;
+		c = qfq_phase_start();
+		*queue_index = qfq_select_txq(q, dev, e->cl, skb);
+		qfq_phase_end(q, QFQ_PHASE_TXQ, c);
+		if (qfq_txq_ready(q, dev, *queue_index))
+			return e;
+		spin_unlock(qfq_cl_lock(e->cl));
+		qfq_txq_stall(q, *queue_index);
+		__clear_bit(grp->index, &mask);
+	}
+
+	return NULL;
+}
+
+/*
+ * Mark a packet leaving a class whose standing queue is above one of its ECN
+ * thresholds: the packets left behind, or the time the packet was queued.
+ * Packets that are not ECN capable are sent unmarked; the class limit still
+ * bounds their queue.
+ */
+static void qfq_ecn_mark(struct qfq_class *cl, struct sk_buff *skb,
+			 int cl_qlen, u64 now)
+{
+	if ((cl->ecn_thresh && cl_qlen >= cl->ecn_thresh) ||
+	    (qfq_cl_stamped(cl) &&
+	     (s64)(now - qfq_skb_cb(skb)->enqueue_time) > (s64)cl->ecn_target)) {
+		if (INET_ECN_set_ce(skb))
+			cl->ecn_mark++;
+	}
+}
+
+/*
+ * Count a dequeued packet in the rate estimate of its class. Once an
+ * interval has passed the average rate since the last estimate is folded
+ * into the EWMA, like gen_estimator does from its timer. Intervals the
+ * class was idle for count as estimates of rate zero, as qfq_est_read()
+ * showed them, and the packets as sent in the last one.
+ */
+static void qfq_est_update(struct qfq_class *cl, unsigned int len, u64 now)
+{
+	u64 elapsed, steps;
+	s64 rate;
+
+	cl->est_bytes += len;
+	cl->est_packets++;
+
+	elapsed = now - cl->est_last;
+	if ((s64)elapsed < (s64)cl->est_interval)
+		return;
+
+	steps = qfq_est_idle_steps(cl, elapsed);
+	qfq_est_decay(cl, &cl->est_bps, &cl->est_pps, steps);
+	elapsed -= steps * cl->est_interval;
+
+	rate = qfq_mul_div(cl->est_bytes, (u64)NSEC_PER_SEC << 5, elapsed);
+	cl->est_bps += (rate - (s64)cl->est_bps) >> cl->est_ewma_log;
+	rate = qfq_mul_div(cl->est_packets, (u64)NSEC_PER_SEC << 5, elapsed);
+	cl->est_pps += (rate - (s64)cl->est_pps) >> cl->est_ewma_log;
+
+	cl->est_last = now;
+	cl->est_bytes = 0;
+	cl->est_packets = 0;
+}
+
+/*
+ * Refill the priority token bucket, kept in ns of transmission at the
+ * priority rate, and tell whether a packet of len bytes may go. A full
+ * bucket lets any packet through, so one larger than the burst is not stuck.
+ */
+static bool qfq_prio_conform(struct qfq_sched *q, unsigned int len, u64 now)
+{
+	s64 burst = div_u64((u64)q->prio_burst * 8000, q->prio_rate);
+	s64 cost = div_u64((u64)len * 8000, q->prio_rate);
+
+	q->prio_tokens = min_t(s64, q->prio_tokens +
+				    (s64)(now - q->prio_t_last), burst);
+	q->prio_t_last = now;
+	return q->prio_tokens >= min(cost, burst);
+}
+
+/*
+ * Packet of the strict priority class, if it has one that conforms to its
+ * token bucket. The packet uses link time the QFQ classes cannot have, so
+ * V of the guaranteed tier is held back over its transmission time rather
+ * than advanced: the classes keep their rates relative to the capacity they
+ * are left with. The excess tier hands out whatever is left over anyway.
+ */
+static struct sk_buff *qfq_prio_dequeue(struct Qdisc *sch, u64 now)
+{
+	struct qfq_sched *q = qdisc_priv(sch);
+	struct net_device *dev = qdisc_dev(sch);
+	struct sk_buff *skb = NULL;
+	struct qfq_class *cl;
+	spinlock_t *class_lock;
+	unsigned int len = 0;
+	u16 queue_index;
+
+	/* Cleared before looking, so a concurrent enqueue sets it again */
+	q->prio_pending = 0;
+	smp_mb();
+
+	rcu_read_lock_bh();
+	cl = rcu_dereference_bh(q->prio_cl);
+	if (cl == NULL)
+		goto out;
+
+	class_lock = qfq_cl_lock(cl);
+	spin_lock(class_lock);
+	skb = qfq_cl_peek(cl);
+	if (skb == NULL)
+		goto unlock;
+
+	len = qfq_wire_len(q, skb);
+	if (!qfq_prio_conform(q, len, now)) {
+		q->prio_throttled++;
+		skb = NULL;
+		goto unlock;
+	}
+
+	qfq_bind_txq(sch, cl);
+	queue_index = qfq_select_txq(q, dev, cl, skb);
+	if (!qfq_txq_ready(q, dev, queue_index)) {
+		qfq_txq_stall(q, queue_index);
+		skb = NULL;
+		goto unlock;
+	}
+
+	skb = qfq_cl_dequeue(cl);
+	if (skb) {
+		skb_set_queue_mapping(skb, queue_index);
+		if (q->mem_budget)
+			atomic_long_sub(qdisc_pkt_len(skb), &q->backlog);
+		if (cl->est_interval)
+			qfq_est_update(cl, qdisc_pkt_len(skb), now);
+		qfq_map_publish(q, cl);
+	}
+unlock:
+	/* Look again next time while packets are left */
+	if (qfq_cl_qlen(cl))
+		q->prio_pending = 1;
+	spin_unlock(class_lock);
+out:
+	rcu_read_unlock_bh();
+
+	if (skb) {
+		u64 tx_time = (u64)len * 8000 / q->link_speed;
+
+		q->prio_tokens -= div_u64((u64)len * 8000, q->prio_rate);
+		q->guar.t_diff_sum += tx_time;
+		qdisc_bstats_update(sch, skb);
+		q->prio_packets++;
+	}
+	return skb;
+}
+
+/*
+ * Log a packet the spinner dequeued, along with the timestamps QFQ scheduled
+ * it by. Only the spinner CPU writes, so its relay buffer is the whole log.
+ */
+static void qfq_log_packet(struct qfq_sched *q, struct qfq_tier *t,
+			   struct qfq_entity *e, unsigned int len, bool last,
+			   u64 now)
+{
+	struct tc_qfq_log_rec rec = {
+		.time		= now,
+		.V		= t->V,
+		.S		= e->S,
+		.F		= e->F,
+		.classid	= e->cl->classid,
+		.len		= len,
+		.inv_w		= e->inv_w,
+		.group		= e->grp->index,
+	};
+
+	if (t == &q->excess)
+		rec.group |= TC_QFQ_LOG_EXCESS;
+	if (last)
+		rec.group |= TC_QFQ_LOG_LAST;
+
+	relay_write(q->log, &rec, sizeof(rec));
+}
+
+static struct sk_buff *qfq_dequeue(struct Qdisc *sch, u64 now)
+{
+	struct qfq_sched *q = qdisc_priv(sch);
+	struct net_device *dev = qdisc_dev(sch);
+	struct qfq_tier *t = &q->guar;
+	struct qfq_group *grp;
+	struct qfq_entity *e;
+	struct qfq_class *cl;
+	struct sk_buff *skb;
+	unsigned int len;
+	unsigned int next_len = 0;
+	int cl_qlen;
+	spinlock_t *class_lock;
+	u16 queue_index = 0;
+	u64 old_V, tx_time;
+
+	/* Update system time V */
+	qfq_update_tiers(q, now);
+	if (!q->guar.bitmaps[ER] && !q->excess.bitmaps[ER])
+		return NULL;
+
+	/* Packets stay in their class (and V untouched) until their
+	 * transmit queue has room for them. Classes are served above their
+	 * weight only when no class is eligible at it.
+	 */
+	e = qfq_pick_class(q, t, dev, &queue_index);
+	if (!e) {
+		t = &q->excess;
+		e = qfq_pick_class(q, t, dev, &queue_index);
+		if (!e)
+			return NULL;
+	}
+	cl = e->cl;
+	grp = e->grp;
+	class_lock = qfq_cl_lock(cl);
+	skb = qfq_cl_dequeue(cl);
+	if (skb && q->mem_budget)
+		atomic_long_sub(qdisc_pkt_len(skb), &q->backlog);
+	cl_qlen = qfq_cl_qlen(cl);
+	if (skb && cl_qlen) {
+//		s64 now = ktime_get().tv64;
+//		s64 dt = now - cl->prev_dequeue_time_ns;
+//		s64 dev = dt - cl->expected_inter_dequeue_time_ns;
+//		if (dev < 0) dev = -dev;
+//		cl->prev_dequeue_time_ns = now;
+//		/* Calculate EWMA */
+//		cl->inter_dequeue_time_ns = ((cl->inter_dequeue_time_ns * 7) + dt) >> 3;
+//		cl->absdev_dequeue_time_ns = ((cl->absdev_dequeue_time_ns * 7) + dev) >> 3;
+		next_len = qfq_peek_len(q, cl);
+	}
+	if (skb && cl->est_interval)
+		qfq_est_update(cl, qdisc_pkt_len(skb), now);
+	qfq_map_publish(q, cl);
+	spin_unlock(class_lock);
+
+	if (!skb) {
+		/* Purged, or emptied by drops of its child qdisc */
+		if (!cl_qlen)
+			qfq_spinner_remove_class(sch, cl);
+		else
+			WARN_ONCE(1, "qfq_dequeue: non-workconserving leaf\n");
+		return NULL;
+	}
+	skb_set_queue_mapping(skb, queue_index);
+	if (cl->ecn_thresh || cl->ecn_target)
+		qfq_ecn_mark(cl, skb, cl_qlen, now);
+
+	/* sch->q.qlen for the QFQ-RL qdisc now denotes the number of activated
+	 * classes. This value is only updated in the dequeue thread.
+	 */
+	if (!cl_qlen)
+		sch->q.qlen--;
+
+	qdisc_bstats_update(sch, skb);
+
+	old_V = t->V;
+	len = qfq_wire_len(q, skb);
+	if (static_key_false(&qfq_log_key) && q->log)
+		qfq_log_packet(q, t, e, len, !cl_qlen, now);
+	qfq_lag_update(q, cl, len, now);
+	if (!cl_qlen)
+		cl->lag_start = 0;
+	//t->V += (u64)len * ONE_FP / max((u32)LINK_SPEED, t->wsum_active);
+	/*
+	 * System time V will be updated over time (real time) rather than
+	 * instantaneously. We just increment appropriate counters now.
+	 */
+	tx_time = (u64)len * 8000 / q->link_speed;
+	t->v_diff_sum += (u64)len * ONE_FP / max(q->link_speed, t->wsum_active);
+	t->t_diff_sum += tx_time;
+	if (t == &q->excess) {
+		q->excess_packets++;
+		cl->excess_packets++;
+	}
+	pr_debug("qfq dequeue: len %u F %lld now %lld\n",
+		 len, (unsigned long long) e->F, (unsigned long long) t->V);
+
+	if (qfq_update_class(t, grp, e, next_len)) {
+		u64 old_F = grp->F;
+
+		q->update_grp_on_deq++;
+		if (e->inv_w && !cl_qlen)
+			t->wsum_active -= ONE_FP / e->inv_w;
+
+		e = qfq_slot_scan(grp);
+		if (!e)
+			__clear_bit(grp->index, &t->bitmaps[ER]);
+		else {
+			u64 roundedS = qfq_round_down(e->S, grp->slot_shift);
+			unsigned int s;
+
+			if (grp->S == roundedS)
+				goto skip_unblock;
+			grp->S = roundedS;
+			grp->F = roundedS + (2ULL << grp->slot_shift);
+			__clear_bit(grp->index, &t->bitmaps[ER]);
+			s = qfq_calc_state(t, grp);
+			__set_bit(grp->index, &t->bitmaps[s]);
+		}
+
+		qfq_unblock_groups(t, grp->index, old_F);
+	} else if (e->inv_w && !cl_qlen)
+		t->wsum_active -= ONE_FP / e->inv_w;
+
+skip_unblock:
+	qfq_update_eligible(t, old_V);
+
+	/* With its last packet gone the class leaves the other tier too */
+	if (!cl_qlen) {
+		if (t == &q->guar)
+			qfq_excess_deactivate(q, cl);
+		else if (!hlist_unhashed(&cl->ent.next)) {
+			qfq_deactivate_ent(&q->guar, &cl->ent);
+			q->guar.wsum_active -= ONE_FP / cl->ent.inv_w;
+		}
+	}
+	if (!qdisc_qlen(sch))
+		q->idle_on_deq++;
+
+	return skb;
+}
+
+/*
+ * Assign a reasonable start time for a new flow k in group i.
+ * Admissible values for \hat(F) are multiples of \sigma_i
+ * no greater than V+\sigma_i . Larger values mean that
+ * we had a wraparound so we consider the timestamp to be stale.
+ *
+ * If F is not stale and F >= V then we set S = F.
+ * Otherwise we should assign S = V, but this may violate
+ * the ordering in ER. So, if we have groups in ER, set S to
+ * the F_j of the first group j which would be blocking us.
+ * We are guaranteed not to move S backward because
+ * otherwise our group i would still be blocked.
+ */
+static void qfq_update_start(struct qfq_tier *t, struct qfq_entity *e)
+{
+	unsigned long mask;
+	u64 limit, roundedF;
+	int slot_shift = e->grp->slot_shift;
+
+	roundedF = qfq_round_down(e->F, slot_shift);
+	limit = qfq_round_down(t->V, slot_shift) + (1ULL << slot_shift);
+
+	if (!qfq_gt(e->F, t->V) || qfq_gt(roundedF, limit)) {
+		/* timestamp was stale */
+		mask = mask_from(t->bitmaps[ER], e->grp->index);
+		if (mask) {
+			struct qfq_group *next = qfq_ffs(t, mask);
+			if (qfq_gt(roundedF, next->F)) {
+				if (qfq_gt(limit, next->F))
+					e->S = next->F;
+				else /* preserve timestamp correctness */
+					e->S = limit;
+				return;
+			}
+		}
+		e->S = t->V;
+	} else  /* timestamp is not stale */
+		e->S = e->F;
+}
+
+static bool qfq_enqueue_work_entry(struct qfq_sched *q, struct qfq_class *cl,
+				   unsigned int pkt_len)
+{
+	struct qfq_cpu_work_queue *work_queue = this_cpu_ptr(q->work_queue);
+	struct qfq_cpu_work_entry *ent = kzalloc(sizeof(*ent), GFP_ATOMIC);
+	unsigned int cpu;
+	if (ent == NULL)
+		return false;
+
+	ent->type = QFQ_WORK_ACTIVATE;
+	ent->cl = cl;
+	ent->pkt_len = pkt_len;
+	ent->time = qfq_now(q);
+	smp_mb();
+
+	spin_lock(&work_queue->lock);
+	list_add_tail(&ent->list, &work_queue->list);
+	work_queue->len++;
+	spin_unlock(&work_queue->lock);
+
+	cpu = smp_processor_id();
+	set_bit(cpu, &q->work_bitmap);
+	return true;
+}
+
+static inline void qfq_count_drop(struct qfq_sched *q,
+				  enum qfq_drop_reason reason, unsigned int n)
+{
+	this_cpu_add(q->drop_stats->drops[reason], n);
+}
+
+/* Signed, as the racy updates can briefly take the backlog below zero */
+static inline bool qfq_over_budget(struct qfq_sched *q, unsigned int len)
+{
+	return atomic_long_read(&q->backlog) + (long)len > (long)q->mem_budget;
+}
+
+/*
+ * A class with about the largest backlog in bytes, see qfq_drop_raise().
+ * Classes found above the bucket of their current backlog are moved down
+ * on the way, which is paid for by the raises that put them there. Classes
+ * of the same bucket take turns. The class is only guaranteed to stay
+ * allocated for an RCU-bh read side section, which the enqueue path and the
+ * tree lock holders are in.
+ */
+static struct qfq_class *qfq_heaviest_class(struct qfq_sched *q)
+{
+	struct list_head *bucket;
+	struct qfq_class *cl = NULL;
+	unsigned int b;
+
+	spin_lock(&q->drop_lock);
+	while (q->drop_map) {
+		bucket = &q->drop_buckets[__fls(q->drop_map)];
+		cl = list_first_entry(bucket, struct qfq_class, drop_node);
+		b = fls(qfq_cl_backlog(cl));
+		if (b < cl->drop_bucket) {
+			qfq_drop_move(q, cl, b);
+			cl = NULL;
+			continue;
+		}
+		list_move_tail(&cl->drop_node, bucket);
+		break;
+	}
+	spin_unlock(&q->drop_lock);
+
+	return cl;
+}
+
+/*
+ * Class with the largest backlog in bytes, for a qdisc without a memory
+ * budget, which keeps no buckets. Walks the class table under RCU, for the
+ * rare drop requests of a parent qdisc.
+ */
+static struct qfq_class *qfq_scan_heaviest(struct qfq_sched *q)
+{
+	struct qfq_class_table *t;
+	struct qfq_class *cl, *victim = NULL;
+	unsigned int i, backlog, max = 0;
+
+	t = rcu_dereference_bh_check(q->cltable, lockdep_rtnl_is_held());
+	for (i = 0; i < t->size; i++) {
+		hlist_for_each_entry_rcu(cl, &t->buckets[i],
+					 hnode[t->node_ver]) {
+			backlog = qfq_cl_backlog(cl);
+			if (backlog > max) {
+				max = backlog;
+				victim = cl;
+			}
+		}
+	}
+
+	return victim;
+}
+
+/*
+ * Drop the tail packet of a class, unless it is the only one. The head
+ * packet of a backlogged class is what the spinner has scheduled, and
+ * emptying the class would mean deactivating it from outside the spinner.
+ */
+static unsigned int qfq_evict(struct Qdisc *sch, struct qfq_class *cl,
+			      enum qfq_drop_reason reason)
+{
+	struct qfq_sched *q = qdisc_priv(sch);
+	spinlock_t *class_lock = qfq_cl_lock(cl);
+	unsigned int len = 0;
+
+	spin_lock(class_lock);
+	if (qfq_cl_qlen(cl) > 1) {
+		len = qfq_cl_drop(cl);
+		qfq_map_publish(q, cl);
+	}
+	spin_unlock(class_lock);
+
+	if (len) {
+		qfq_count_drop(q, reason, 1);
+		if (q->mem_budget)
+			atomic_long_sub(len, &q->backlog);
+	}
+	return len;
+}
+
+/*
+ * Evict packets from the class with the largest backlog until len more bytes
+ * fit in the memory budget. Returns false if cl is itself the largest, in
+ * which case the new packet is the one to drop. Enqueues on other CPUs can
+ * overshoot the budget by a packet each.
+ */
+static bool qfq_make_room(struct Qdisc *sch, struct qfq_class *cl,
+			  unsigned int len)
+{
+	struct qfq_sched *q = qdisc_priv(sch);
+	struct qfq_class *victim;
+
+	while (qfq_over_budget(q, len)) {
+		victim = qfq_heaviest_class(q);
+		if (victim == NULL || victim == cl ||
+		    !qfq_evict(sch, victim, QFQ_DROP_BUDGET))
+			return false;
+	}
+
+	return true;
+}
+
+static int qfq_enqueue(struct sk_buff *skb, struct Qdisc *sch)
+{
+	struct qfq_sched *q = qdisc_priv(sch);
+	struct qfq_class *cl;
+	spinlock_t *class_lock;
+	unsigned int len, wire_len;
+	int cl_qlen = 0;
+	int err = 0;
+	cl = qfq_classify(skb, sch, &err);
+	if (cl == NULL) {
+		if (err & __NET_XMIT_BYPASS)
+			qfq_count_drop(q, QFQ_DROP_CLASSIFY, 1);
+		kfree_skb(skb);
+		return err;
+	}
+
+	if (skb->sk) {
+		skb->sk->qdisc_cache = (void *)sch;
+		skb->sk->cl_cache = (void *)cl;
+	}
+
+	pr_debug("qfq_enqueue: cl = %x\n", cl->classid);
+
+	if (qfq_cl_stamped(cl))
+		qfq_skb_cb(skb)->enqueue_time = qfq_now(q);
+
+	len = qdisc_pkt_len(skb);
+	wire_len = qfq_wire_len(q, skb);
+	class_lock = qfq_cl_lock(cl);
+	if (q->mem_budget &&
+	    qfq_over_budget(q, len) &&
+	    !qfq_make_room(sch, cl, len)) {
+		spin_lock(class_lock);
+		cl->qstats.drops++;
+		qfq_map_publish(q, cl);
+		spin_unlock(class_lock);
+		qfq_count_drop(q, QFQ_DROP_BUDGET, 1);
+		kfree_skb(skb);
+		return NET_XMIT_DROP;
+	}
+
+	/* Class counters are only updated with the class lock held. */
+	spin_lock(class_lock);
+	if (unlikely(cl->dead)) {
+		/* Deleted since it was looked up */
+		spin_unlock(class_lock);
+		qfq_count_drop(q, QFQ_DROP_CLASSIFY, 1);
+		kfree_skb(skb);
+		return NET_XMIT_DROP;
+	}
+	err = qfq_cl_enqueue(skb, cl);
+	if (err == NET_XMIT_SUCCESS) {
+		bstats_update(&cl->bstats, skb);
+		if (q->mem_budget)
+			atomic_long_add(len, &q->backlog);
+		qfq_drop_raise(q, cl);
+	}
+	cl_qlen = qfq_cl_qlen(cl);
+
+	/*
+	 * A class that was idle is handed to the spinner. The work entry is
+	 * queued with the class lock held, so qfq_delete_class() finds it
+	 * once it marked the class dead.
+	 */
+	if (err == NET_XMIT_SUCCESS && cl_qlen == 1 && !cl->prio &&
+	    (cl->ent.inv_w != ONE_FP + 1 || cl->xs.inv_w != ONE_FP + 1) &&
+	    unlikely(!qfq_enqueue_work_entry(q, cl, wire_len))) {
+		/* The spinner will never look at this class, so do not
+		 * leave packets in it. The next enqueue tries again.
+		 */
+		cl->qstats.drops += cl_qlen;
+		if (q->mem_budget)
+			atomic_long_sub(qfq_cl_backlog(cl), &q->backlog);
+		qfq_cl_reset(cl);
+		err = NET_XMIT_DROP;
+		qfq_map_publish(q, cl);
+		spin_unlock(class_lock);
+		qfq_count_drop(q, QFQ_DROP_ACTIVATE, cl_qlen);
+		return err;
+	}
+	qfq_map_publish(q, cl);
+	spin_unlock(class_lock);
+
+	if (unlikely(err != NET_XMIT_SUCCESS)) {
+		pr_debug("qfq_enqueue: enqueue failed %d\n", err);
+		if (net_xmit_drop_count(err))
+			qfq_count_drop(q, QFQ_DROP_LIMIT, 1);
+		return err;
+	}
+	//++sch->q.qlen;
+
+	/* The spinner looks at the priority class whenever this is set */
+	if (cl->prio)
+		q->prio_pending = 1;
+
+	return err;
+}
+
+static int qfq_enqueue_safe(struct sk_buff *skb, struct Qdisc *sch)
+{
+	int rc;
+	spinlock_t *root_lock = qdisc_lock(sch);
+
+	spin_lock(root_lock);
+	rc = qfq_enqueue(skb, sch);
+	spin_unlock(root_lock);
+
+	return rc;
+}
+
+/*
+ * Handle class switch from idle to backlogged.
+ */
+static void qfq_activate_ent(struct qfq_tier *t, struct qfq_entity *e,
+			     unsigned int pkt_len)
+{
+	struct qfq_group *grp = e->grp;
+	u64 roundedS;
+	int s;
+
+	qfq_update_start(t, e);
+
+	/* compute new finish time and rounded start. */
+	e->F = e->S + (u64)pkt_len * e->inv_w;
+	roundedS = qfq_round_down(e->S, grp->slot_shift);
+
+	/*
+	 * insert cl in the correct bucket.
+	 * If e->S >= grp->S we don't need to adjust the
+	 * bucket list and simply go to the insertion phase.
+	 * Otherwise grp->S is decreasing, we must make room
+	 * in the bucket list, and also recompute the group state.
+	 * Finally, if there were no flows in this group and nobody
+	 * was in ER make sure to adjust V.
+	 */
+	if (grp->full_slots) {
+		if (!qfq_gt(grp->S, e->S))
+			goto skip_update;
+
+		/* create a slot for this e->S */
+		qfq_slot_rotate(grp, roundedS);
+		/* group was surely ineligible, remove */
+		__clear_bit(grp->index, &t->bitmaps[IR]);
+		__clear_bit(grp->index, &t->bitmaps[IB]);
+	}
+	/*
+	 * For standard QFQ, if the group was empty before (all slots empty) and
+	 * no other classes were [ER] then V would be lagging behind and must
+	 * be updated to make this group eligible immediately. This occurs when
+	 * the link was earlier idle and a new class needs to be activated.
+	 */
+
+	grp->S = roundedS;
+	grp->F = roundedS + (2ULL << grp->slot_shift);
+	s = qfq_calc_state(t, grp);
+	__set_bit(grp->index, &t->bitmaps[s]);
+
+	pr_debug("qfq enqueue: new state %d %#lx S %lld F %lld V %lld\n",
+		 s, t->bitmaps[s],
+		 (unsigned long long) e->S,
+		 (unsigned long long) e->F,
+		 (unsigned long long) t->V);
+
+skip_update:
+	qfq_slot_insert(t, grp, e, roundedS);
+}
+
+
+static void qfq_slot_remove(struct qfq_tier *t, struct qfq_group *grp,
+			    struct qfq_entity *e)
+{
+	unsigned int i, offset;
+	u64 roundedS;
+
+	roundedS = qfq_round_down(e->S, grp->slot_shift);
+	offset = (roundedS - grp->S) >> grp->slot_shift;
+	i = (grp->front + offset) % QFQ_MAX_SLOTS;
+
+	hlist_del_init(&e->next);
+	if (hlist_empty(&grp->slots[i]))
+		__clear_bit(offset, &grp->full_slots);
+}
+
+/*
+ * called to forcibly destroy a queue.
+ * If the queue is not in the front bucket, or if it has
+ * other queues in the front bucket, we can simply remove
+ * the queue with no other side effects.
+ * Otherwise we must propagate the event up.
+ */
+static void qfq_deactivate_ent(struct qfq_tier *t, struct qfq_entity *e)
+{
+	struct qfq_group *grp = e->grp;
+	unsigned long mask;
+	u64 roundedS;
+	int s;
+
+	e->F = e->S;
+	qfq_slot_remove(t, grp, e);
+
+	if (!grp->full_slots) {
+		__clear_bit(grp->index, &t->bitmaps[IR]);
+		__clear_bit(grp->index, &t->bitmaps[EB]);
+		__clear_bit(grp->index, &t->bitmaps[IB]);
+
+		if (test_bit(grp->index, &t->bitmaps[ER]) &&
+		    !(t->bitmaps[ER] & ~((1UL << grp->index) - 1))) {
+			mask = t->bitmaps[ER] & ((1UL << grp->index) - 1);
+			if (mask)
+				mask = ~((1UL << __fls(mask)) - 1);
+			else
+				mask = ~0UL;
+			qfq_move_groups(t, mask, EB, ER);
+			qfq_move_groups(t, mask, IB, IR);
+		}
+		__clear_bit(grp->index, &t->bitmaps[ER]);
+	} else if (hlist_empty(&grp->slots[grp->front])) {
+		e = qfq_slot_scan(grp);
+		roundedS = qfq_round_down(e->S, grp->slot_shift);
+		if (grp->S != roundedS) {
+			__clear_bit(grp->index, &t->bitmaps[ER]);
+			__clear_bit(grp->index, &t->bitmaps[IR]);
+			__clear_bit(grp->index, &t->bitmaps[EB]);
+			__clear_bit(grp->index, &t->bitmaps[IB]);
+			grp->S = roundedS;
+			grp->F = roundedS + (2ULL << grp->slot_shift);
+			s = qfq_calc_state(t, grp);
+			__set_bit(grp->index, &t->bitmaps[s]);
+		}
+	}
+
+	qfq_update_eligible(t, t->V);
+}
+
+/* The lag of a class is measured in the guaranteed tier only. */
+static void qfq_activate_class(struct qfq_sched *q, struct qfq_class *cl,
+			       unsigned int pkt_len)
+{
+	qfq_activate_ent(&q->guar, &cl->ent, pkt_len);
+	qfq_lag_start(q, cl);
+}
+
+static void qfq_deactivate_class(struct qfq_sched *q, struct qfq_class *cl)
+{
+	cl->lag_start = 0;
+	if (!hlist_unhashed(&cl->ent.next))
+		qfq_deactivate_ent(&q->guar, &cl->ent);
+	qfq_excess_deactivate(q, cl);
+}
+
+/*
+ * Schedule a backlogged class in the excess tier too, if it has a ceiling
+ * above its weight. Both tiers hold it back at their own rate, so it never
+ * gets more than the ceiling. The excess tier keeps its own wsum_active.
+ */
+static void qfq_excess_activate(struct qfq_sched *q, struct qfq_class *cl,
+				unsigned int pkt_len)
+{
+	if (cl->xs.inv_w == ONE_FP + 1 || !hlist_unhashed(&cl->xs.next))
+		return;
+
+	qfq_activate_ent(&q->excess, &cl->xs, pkt_len);
+	q->excess.wsum_active += ONE_FP / cl->xs.inv_w;
+}
+
+static void qfq_excess_deactivate(struct qfq_sched *q, struct qfq_class *cl)
+{
+	if (hlist_unhashed(&cl->xs.next))
+		return;
+
+	qfq_deactivate_ent(&q->excess, &cl->xs);
+	q->excess.wsum_active -= ONE_FP / cl->xs.inv_w;
+}
+
+/*
+ * Take a class that has no packets left out of both tiers, as the dequeue
+ * path does when its last packet leaves. Only called from the spinner.
+ */
+static void qfq_spinner_remove_class(struct Qdisc *sch, struct qfq_class *cl)
+{
+	struct qfq_sched *q = qdisc_priv(sch);
+
+	if (!qfq_cl_active(cl))
+		return;
+
+	if (!hlist_unhashed(&cl->ent.next))
+		q->guar.wsum_active -= ONE_FP / cl->ent.inv_w;
+	qfq_deactivate_class(q, cl);
+	sch->q.qlen--;
+}
+
+static void qfq_qlen_notify(struct Qdisc *sch, unsigned long arg)
+{
+	struct qfq_sched *q = qdisc_priv(sch);
+	struct qfq_class *cl = (struct qfq_class *)arg;
+	struct qfq_cpu_work_entry *ent;
+
+	if (qfq_cl_qlen(cl) || cl->prio)
+		return;
+
+	/* Like qfq_graft_class, the dequeue path catches up if this fails */
+	ent = qfq_alloc_remove(cl, GFP_ATOMIC);
+	if (ent)
+		qfq_post_entry(q, ent);
+}
+
+static unsigned int qfq_drop(struct Qdisc *sch)
+{
+	struct qfq_sched *q = qdisc_priv(sch);
+	struct qfq_class *cl;
+
+	/* Push back on the class with the largest backlog */
+	cl = q->mem_budget ? qfq_heaviest_class(q) : qfq_scan_heaviest(q);
+	return cl ? qfq_evict(sch, cl, QFQ_DROP_PARENT) : 0;
+}
+
+static int qfq_dump_qdisc_stats(struct Qdisc *sch, struct gnet_dump *d)
+{
+	struct qfq_sched *q = qdisc_priv(sch);
+	struct tc_qfq_xstats xstats = {.type = TCA_QFQ_XSTATS_QDISC};
+	u64 drops[__QFQ_DROP_MAX];
+	unsigned int cpu;
+	int i;
+
+	xstats.qdisc_stats.v_forwarded = q->v_forwarded;
+	xstats.qdisc_stats.idle_on_deq = q->idle_on_deq;
+	xstats.qdisc_stats.update_grp_on_deq = q->update_grp_on_deq;
+	xstats.qdisc_stats.txq_blocked = q->txq_blocked;
+	xstats.qdisc_stats.wsum_active = q->guar.wsum_active;
+	xstats.qdisc_stats.activations = q->activations;
+	xstats.qdisc_stats.activation_passes = q->activation_passes;
+	xstats.qdisc_stats.work_depth_max = q->work_depth_max;
+	xstats.qdisc_stats.work_pass_max = q->work_pass_max;
+	xstats.qdisc_stats.lag_max = q->lag_max;
+	xstats.qdisc_stats.work_deferred = q->work_deferred;
+	xstats.qdisc_stats.credit_capped = q->credit_capped;
+	xstats.qdisc_stats.credit_dropped = q->credit_dropped;
+	xstats.qdisc_stats.prio_packets = q->prio_packets;
+	xstats.qdisc_stats.prio_throttled = q->prio_throttled;
+	xstats.qdisc_stats.spin_busy = q->spin_busy;
+	xstats.qdisc_stats.spin_idle = q->spin_idle;
+	xstats.qdisc_stats.v_diff_sum = q->guar.v_diff_sum;
+	xstats.qdisc_stats.t_diff_sum = q->guar.t_diff_sum;
+	xstats.qdisc_stats.excess_packets = q->excess_packets;
+	xstats.qdisc_stats.excess_wsum_active = q->excess.wsum_active;
+
+	memset(drops, 0, sizeof(drops));
+	for_each_possible_cpu(cpu) {
+		struct qfq_drop_stats *ds = per_cpu_ptr(q->drop_stats, cpu);
+
+		for (i = 0; i < __QFQ_DROP_MAX; i++)
+			drops[i] += ds->drops[i];
+	}
+	xstats.qdisc_stats.drop_classify = drops[QFQ_DROP_CLASSIFY];
+	xstats.qdisc_stats.drop_limit = drops[QFQ_DROP_LIMIT];
+	xstats.qdisc_stats.drop_activate = drops[QFQ_DROP_ACTIVATE];
+	xstats.qdisc_stats.drop_budget = drops[QFQ_DROP_BUDGET];
+	xstats.qdisc_stats.drop_parent = drops[QFQ_DROP_PARENT];
+	sch->qstats.drops = 0;
+	for (i = 0; i < __QFQ_DROP_MAX; i++)
+		sch->qstats.drops += drops[i];
+
+	if (q->mem_budget)
+		sch->qstats.backlog = atomic_long_read(&q->backlog);
+
+	return gnet_stats_copy_app(d, &xstats, sizeof(xstats));
+}
+
+/*
+ * Wait until a packet is enqueued in the qdisc.
+ * We call the kernel schedule() function and check if the kthread should stop
+ * only once every few iterations of the queue length checking loop if the
+ * qdisc is idle.
+ */
+static void qfq_spinner_wait_for_skb(struct Qdisc *sch)
+{
+	struct qfq_sched *q = qdisc_priv(sch);
+	int schedule_counter = 0;
+	while ((qdisc_qlen(sch) == 0) &&
+	       (schedule_counter || !kthread_should_stop()) &&
+	       (!q->work_bitmap) && !q->work_cpus &&
+	       !ACCESS_ONCE(q->prio_pending) && !ACCESS_ONCE(q->snap_req) &&
+	       !ACCESS_ONCE(q->reset_pending)) {
+		schedule_counter++;
+		if (schedule_counter >= 10000) {
+			schedule_counter = 0;
+			schedule();
+		}
+	}
+}
+
+/*
+ * Work entries processed per pass over the work queues, so that a burst of
+ * activations cannot hold off dequeues for long.
+ */
+#define QFQ_WORK_BUDGET		128
+
+/* Schedule a backlogged class in the tiers it is not active in yet. */
+static void qfq_spinner_activate(struct Qdisc *sch, struct qfq_class *cl,
+				 unsigned int pkt_len)
+{
+	struct qfq_sched *q = qdisc_priv(sch);
+	bool was_active;
+
+	/* The class may already have been activated in either tier by a
+	 * weight change, or its weight may now be zero.
+	 *
+	 * We do not acquire the class lock here since we only activate the
+	 * class and do not update the class qdisc.
 	 */
-	if (!cl_qlen)
-		sch->q.qlen--;
+	was_active = qfq_cl_active(cl);
+	if (hlist_unhashed(&cl->ent.next) &&
+	    cl->ent.inv_w != ONE_FP + 1) {
+		qfq_activate_class(q, cl, pkt_len);
+		q->guar.wsum_active += ONE_FP / cl->ent.inv_w;
+	}
+	qfq_excess_activate(q, cl, pkt_len);
 
-	qdisc_bstats_update(sch, skb);
+	if (!was_active && qfq_cl_active(cl)) {
+		qfq_bind_txq(sch, cl);
+		++sch->q.qlen;
+	}
+}
 
-	old_V = q->V;
-	len = qdisc_pkt_len(skb);
-	//q->V += (u64)len * ONE_FP / max((u32)LINK_SPEED, q->wsum_active);
-	/*
-	 * System time V will be updated over time (real time) rather than
-	 * instantaneously. We just increment appropriate counters now.
+/* Perform one work entry. Called with the lock of its work queue held. */
+static void qfq_spinner_do_work(struct Qdisc *sch,
+				struct qfq_cpu_work_entry *ent)
+{
+	struct qfq_class *cl = ent->cl;
+
+	if (ent->type == QFQ_WORK_UPDATE) {
+		qfq_apply_class_params(sch, cl, ent->lmax, ent->inv_w,
+				       ent->xs_inv_w);
+		return;
+	}
+
+	if (ent->type == QFQ_WORK_REMOVE) {
+		/* Packets queued since the purge keep it in */
+		if (!qfq_cl_qlen(cl))
+			qfq_spinner_remove_class(sch, cl);
+		return;
+	}
+
+	qfq_spinner_activate(sch, cl, ent->pkt_len);
+}
+
+/* Note the time of the first entry of a queue, or drop the queue if empty. */
+static void qfq_work_peek(struct qfq_sched *q, unsigned int cpu,
+			  struct qfq_cpu_work_queue *work_queue)
+{
+	struct qfq_cpu_work_entry *ent;
+
+	if (list_empty(&work_queue->list)) {
+		__clear_bit(cpu, &q->work_cpus);
+		return;
+	}
+
+	ent = list_first_entry(&work_queue->list, struct qfq_cpu_work_entry,
+			       list);
+	work_queue->head_time = ent->time;
+}
+
+/*
+ * Perform the work queued by the CPUs in the order it was queued in, by
+ * merging the per CPU queues on their timestamps: the queue with the oldest
+ * first entry is drained until its entries get newer than the first entry
+ * of another queue. Entries are processed with the lock of their queue
+ * held, which qfq_flush_class_work relies on.
+ */
+static void qfq_spinner_activate_classes(struct Qdisc *sch, u64 now)
+{
+	struct qfq_sched *q = qdisc_priv(sch);
+	struct qfq_cpu_work_queue *work_queue;
+	struct qfq_cpu_work_entry *ent;
+	unsigned int budget = QFQ_WORK_BUDGET;
+	unsigned int cpu, first, depth = 0;
+	u64 oldest, next, t;
+
+	/* We just check the work bitmap without atomicity to see if there is
+	 * any  work at all. Even if it is incorrect, we would eventually read
+	 * the correct values in another iteration.
 	 */
-	q->v_diff_sum += (u64)len * ONE_FP / max((u32)LINK_SPEED, q->wsum_active);
-	q->t_diff_sum += (u64)len * NSEC_PER_SEC / (125000 * LINK_SPEED);
-	pr_debug("qfq dequeue: len %u F %lld now %lld\n",
-		 len, (unsigned long long) cl->F, (unsigned long long) q->V);
+	if (!q->work_bitmap && !q->work_cpus)
+		return;
 
-	if (qfq_update_class(q, grp, cl, next_len)) {
-		u64 old_F = grp->F;
+	qfq_update_tiers(q, now);
+	q->activation_passes++;
 
-		//q->update_grp_on_deq++;
-		if (cl->inv_w && !cl_qlen)
-			q->wsum_active -= ONE_FP / cl->inv_w;
+	for_each_possible_cpu(cpu) {
+		if (!test_and_clear_bit(cpu, &q->work_bitmap))
+			continue;
 
-		cl = qfq_slot_scan(grp);
-		if (!cl)
-			__clear_bit(grp->index, &q->bitmaps[ER]);
-		else {
-			u64 roundedS = qfq_round_down(cl->S, grp->slot_shift);
-			unsigned int s;
+		work_queue = per_cpu_ptr(q->work_queue, cpu);
+		__set_bit(cpu, &q->work_cpus);
+		spin_lock(&work_queue->lock);
+		qfq_work_peek(q, cpu, work_queue);
+		spin_unlock(&work_queue->lock);
+	}
 
-			if (grp->S == roundedS)
-				goto skip_unblock;
-			grp->S = roundedS;
-			grp->F = roundedS + (2ULL << grp->slot_shift);
-			__clear_bit(grp->index, &q->bitmaps[ER]);
-			s = qfq_calc_state(q, grp);
-			__set_bit(grp->index, &q->bitmaps[s]);
+	/* Backlog of the queues, which may exceed what one pass processes */
+	for_each_set_bit(cpu, &q->work_cpus, BITS_PER_LONG)
+		depth += ACCESS_ONCE(per_cpu_ptr(q->work_queue, cpu)->len);
+	if (depth > q->work_depth_max)
+		q->work_depth_max = depth;
+
+	while (q->work_cpus && budget) {
+		/* Queue with the oldest entry, and the time it is drained to */
+		first = nr_cpu_ids;
+		oldest = next = U64_MAX;
+		for_each_set_bit(cpu, &q->work_cpus, BITS_PER_LONG) {
+			t = per_cpu_ptr(q->work_queue, cpu)->head_time;
+			if (t < oldest) {
+				next = oldest;
+				oldest = t;
+				first = cpu;
+			} else if (t < next) {
+				next = t;
+			}
 		}
 
-		qfq_unblock_groups(q, grp->index, old_F);
-	} else if (cl->inv_w && !cl_qlen)
-		q->wsum_active -= ONE_FP / cl->inv_w;
-
-skip_unblock:
-	qfq_update_eligible(q, old_V);
-//	if (!qdisc_qlen(sch))
-//		q->idle_on_deq++;
+		work_queue = per_cpu_ptr(q->work_queue, first);
+		spin_lock(&work_queue->lock);
+		while (budget && !list_empty(&work_queue->list)) {
+			ent = list_first_entry(&work_queue->list,
+					       struct qfq_cpu_work_entry, list);
+			if (ent->time > next)
+				break;
+			list_del(&ent->list);
+			work_queue->len--;
+			qfq_spinner_do_work(sch, ent);
+			if (ent->done)
+				complete(ent->done);
+			else
+				kfree(ent);
+			budget--;
+		}
+		qfq_work_peek(q, first, work_queue);
+		spin_unlock(&work_queue->lock);
+	}
 
-	return skb;
+	q->activations += QFQ_WORK_BUDGET - budget;
+	if (QFQ_WORK_BUDGET - budget > q->work_pass_max)
+		q->work_pass_max = QFQ_WORK_BUDGET - budget;
+	if (q->work_cpus)
+		q->work_deferred++;
 }
 
 /*
- * Assign a reasonable start time for a new flow k in group i.
- * Admissible values for \hat(F) are multiples of \sigma_i
- * no greater than V+\sigma_i . Larger values mean that
- * we had a wraparound so we consider the timestamp to be stale.
- *
- * If F is not stale and F >= V then we set S = F.
- * Otherwise we should assign S = V, but this may violate
- * the ordering in ER. So, if we have groups in ER, set S to
- * the F_j of the first group j which would be blocking us.
- * We are guaranteed not to move S backward because
- * otherwise our group i would still be blocked.
+ * Keep snap->top sorted by backlog, dropping the smallest when full. A class
+ * is listed with its entity in the guaranteed tier if it has one there.
  */
-static void qfq_update_start(struct qfq_sched *q, struct qfq_class *cl)
+static void qfq_snapshot_class(struct qfq_snapshot *snap,
+			       struct qfq_entity *e, bool excess)
 {
-	unsigned long mask;
-	u64 limit, roundedF;
-	int slot_shift = cl->grp->slot_shift;
+	struct qfq_class *cl = e->cl;
+	unsigned int backlog = qfq_cl_backlog(cl);
+	unsigned int i = snap->nr_top;
 
-	roundedF = qfq_round_down(cl->F, slot_shift);
-	limit = qfq_round_down(q->V, slot_shift) + (1ULL << slot_shift);
+	if (i == QFQ_SNAP_TOP) {
+		if (backlog <= snap->top[i - 1].backlog)
+			return;
+		i--;
+	} else
+		snap->nr_top++;
+
+	for (; i > 0 && snap->top[i - 1].backlog < backlog; i--)
+		snap->top[i] = snap->top[i - 1];
+
+	snap->top[i].classid = cl->classid;
+	snap->top[i].excess = excess;
+	snap->top[i].index = e->grp->index;
+	snap->top[i].backlog = backlog;
+	snap->top[i].qlen = qfq_cl_qlen(cl);
+	snap->top[i].S = e->S;
+	snap->top[i].F = e->F;
+}
 
-	if (!qfq_gt(cl->F, q->V) || qfq_gt(roundedF, limit)) {
-		/* timestamp was stale */
-		mask = mask_from(q->bitmaps[ER], cl->grp->index);
-		if (mask) {
-			struct qfq_group *next = qfq_ffs(q, mask);
-			if (qfq_gt(roundedF, next->F)) {
-				if (qfq_gt(limit, next->F))
-					cl->S = next->F;
-				else /* preserve timestamp correctness */
-					cl->S = limit;
-				return;
+/* Copy the groups of tier t; classes are counted in the guaranteed tier */
+static void qfq_snapshot_tier(struct qfq_snapshot *snap, struct qfq_tier *t,
+			      struct qfq_snap_group *groups, bool excess)
+{
+	struct qfq_snap_group *sg;
+	struct qfq_group *grp;
+	struct qfq_entity *e;
+	unsigned int i, j;
+
+	for (i = 0; i <= QFQ_MAX_INDEX; i++) {
+		grp = &t->groups[i];
+		sg = &groups[i];
+		sg->S = grp->S;
+		sg->F = grp->F;
+		sg->front = grp->front;
+		sg->full_slots = grp->full_slots;
+		for (j = 0; j < QFQ_MAX_SLOTS; j++) {
+			struct hlist_head *slot;
+
+			slot = &grp->slots[(grp->front + j) % QFQ_MAX_SLOTS];
+			hlist_for_each_entry(e, slot, next) {
+				sg->slot_len[j]++;
+				if (excess && !hlist_unhashed(&e->cl->ent.next))
+					continue;
+				snap->nr_active++;
+				qfq_snapshot_class(snap, e, excess);
 			}
 		}
-		cl->S = q->V;
-	} else  /* timestamp is not stale */
-		cl->S = cl->F;
+	}
 }
 
-static void qfq_enqueue_work_entry(struct qfq_sched *q, struct qfq_class *cl,
-				   unsigned int pkt_len)
+/*
+ * Answer a pending snapshot request. Only the spinner changes the group and
+ * slot state, so copying it here is consistent without locking. Backlogs are
+ * read without the class locks and may be a packet off.
+ */
+static void qfq_spinner_snapshot(struct Qdisc *sch, u64 now)
 {
-	struct qfq_cpu_work_queue *work_queue = this_cpu_ptr(q->work_queue);
-	struct qfq_cpu_work_entry *ent = kzalloc(sizeof(*ent), GFP_ATOMIC);
-	unsigned int cpu;
-	if (ent == NULL) {
-		printk("qfq_enqueue: FIX FIX FIX -- Work entry creation failed."
-		       " Class not activated. This can cause problems.\n");
+	struct qfq_sched *q = qdisc_priv(sch);
+	struct qfq_snapshot *snap = xchg(&q->snap_req, NULL);
+
+	if (!snap)
+		return;
+
+	snap->now = now;
+	snap->V = q->guar.V;
+	snap->wsum = q->wsum;
+	snap->wsum_active = q->guar.wsum_active;
+	snap->excess_V = q->excess.V;
+	snap->xs_wsum = q->xs_wsum;
+	snap->excess_wsum_active = q->excess.wsum_active;
+	snap->qlen = sch->q.qlen;
+	memcpy(snap->bitmaps, q->guar.bitmaps, sizeof(snap->bitmaps));
+	memcpy(snap->excess_bitmaps, q->excess.bitmaps,
+	       sizeof(snap->excess_bitmaps));
+
+	qfq_snapshot_tier(snap, &q->guar, snap->groups, false);
+	qfq_snapshot_tier(snap, &q->excess, snap->excess_groups, true);
+
+	complete(&snap->done);
+}
+
+/*
+ * Hand a packet to the driver on the queue qfq_dequeue picked for it.
+ * Returns false if the driver did not take it.
+ */
+static bool qfq_xmit(struct net_device *dev, struct sk_buff *skb)
+{
+	struct netdev_queue *txq;
+	unsigned int skb_len;
+	int rc;
+
+	txq = netdev_get_tx_queue(dev, skb_get_queue_mapping(skb));
+	if (netif_xmit_frozen_or_stopped(txq))
+		return false;
+
+	/* The kernel does a lot of stuff which we can quickly
+	 * bypass.  We know the features of our NIC --
+	 * supports hardware checksumming, supports GSO, etc.
+	 * And, only one thread dequeues packets.  So we don't
+	 * need any lock.
+	 */
+	skb_len = skb->len;
+	rc = dev->netdev_ops->ndo_start_xmit(skb, dev);
+	/* We should trace ndo_start_xmit similar to the way it
+	 * is used in other places, but compiler complains that
+	 * symbol was not found.
+	 */
+	/* trace_net_dev_xmit(skb, rc, dev, skb_len); */
+	if (rc != NETDEV_TX_OK)
+		return false;
+
+	txq_trans_update(txq);
+	return true;
+}
+
+/*
+ * Send a freshly dequeued packet. V already accounts for it, so a packet the
+ * driver refuses is parked on its queue and retried from there while the
+ * spinner keeps serving classes that send to other queues.
+ */
+static void qfq_spinner_xmit(struct Qdisc *sch, struct sk_buff *skb)
+{
+	struct qfq_sched *q = qdisc_priv(sch);
+	u16 queue_index = skb_get_queue_mapping(skb);
+
+	if (qfq_xmit(qdisc_dev(sch), skb)) {
+		q->txqs[queue_index].stalled = false;
 		return;
 	}
 
-	ent->cl = cl;
-	ent->pkt_len = pkt_len;
-	smp_mb();
+	q->txqs[queue_index].parked = skb;
+	q->nr_parked++;
+	qfq_txq_stall(q, queue_index);
+}
 
-	spin_lock(&work_queue->lock);
-	list_add_tail(&ent->list, &work_queue->list);
-	spin_unlock(&work_queue->lock);
+static void qfq_spinner_retry_parked(struct Qdisc *sch)
+{
+	struct qfq_sched *q = qdisc_priv(sch);
+	struct qfq_txq *t;
+	unsigned int i;
 
-	cpu = smp_processor_id();
-	set_bit(cpu, &q->work_bitmap);
+	for (i = 0; i < q->num_txqs && q->nr_parked; i++) {
+		t = &q->txqs[i];
+		if (!t->parked || !qfq_xmit(qdisc_dev(sch), t->parked))
+			continue;
+		t->parked = NULL;
+		t->stalled = false;
+		q->nr_parked--;
+	}
 }
 
-static int qfq_enqueue(struct sk_buff *skb, struct Qdisc *sch)
+/*
+ * Answer qfq_reset_qdisc by taking every class out of the tiers and dropping
+ * the packets parked on stalled transmit queues, which only the spinner
+ * touches while it runs. A class refilled since its queue was purged is put
+ * back in, as the work entry that activated it may have been discarded by
+ * the reset.
+ */
+static void qfq_spinner_reset(struct Qdisc *sch, u64 now)
 {
 	struct qfq_sched *q = qdisc_priv(sch);
+	struct qfq_tier *tiers[] = { &q->guar, &q->excess };
+	struct qfq_class_table *t;
+	struct qfq_group *grp;
+	struct qfq_entity *e;
 	struct qfq_class *cl;
-	spinlock_t *class_lock;
-	int cl_qlen = 0;
-	int err = 0;
-	cl = qfq_classify(skb, sch, &err);
-	if (cl == NULL) {
-		if (err & __NET_XMIT_BYPASS)
-			sch->qstats.drops++;
-		kfree_skb(skb);
-		return err;
+	struct hlist_node *tmp;
+	unsigned int i, j, k;
+
+	/* Cleared before looking, so a concurrent reset sets it again */
+	q->reset_pending = 0;
+	smp_mb();
+
+	for (k = 0; k < ARRAY_SIZE(tiers); k++) {
+		for (i = 0; i <= QFQ_MAX_INDEX; i++) {
+			grp = &tiers[k]->groups[i];
+			for (j = 0; j < QFQ_MAX_SLOTS; j++) {
+				hlist_for_each_entry_safe(e, tmp,
+							  &grp->slots[j], next)
+					qfq_spinner_remove_class(sch, e->cl);
+			}
+		}
 	}
 
-	if (skb->sk) {
-		skb->sk->qdisc_cache = (void *)sch;
-		skb->sk->cl_cache = (void *)cl;
+	for (i = 0; i < q->num_txqs; i++) {
+		kfree_skb(q->txqs[i].parked);
+		q->txqs[i].parked = NULL;
+		q->txqs[i].stalled = false;
+	}
+	q->nr_parked = 0;
+
+	qfq_update_tiers(q, now);
+	rcu_read_lock_bh();
+	t = rcu_dereference_bh(q->cltable);
+	for (i = 0; i < t->size; i++) {
+		hlist_for_each_entry_rcu(cl, &t->buckets[i],
+					 hnode[t->node_ver]) {
+			if (!cl->prio && qfq_cl_qlen(cl))
+				qfq_spinner_activate(sch, cl,
+						     qfq_peek_len(q, cl));
+		}
 	}
+	rcu_read_unlock_bh();
+}
 
-	pr_debug("qfq_enqueue: cl = %x\n", cl->common.classid);
+static int qfq_spinner(void *_qdisc)
+{
+	struct Qdisc *sch = _qdisc;
+	struct qfq_sched *q = qdisc_priv(sch);
+	struct task_struct *tsk = current;
+	struct sched_param param = { .sched_priority = MAX_RT_PRIO - 1 };
+	struct sk_buff *skb;
+	int schedule_counter = 0;
+	cycles_t t;
+	u64 now;
 
-	class_lock = qdisc_lock(cl->qdisc);
-	spin_lock(class_lock);
-	err = qdisc_enqueue(skb, cl->qdisc);
-	cl_qlen = qdisc_qlen(cl->qdisc);
-	spin_unlock(class_lock);
+	sched_setscheduler(tsk, SCHED_FIFO, &param);
+	printk(KERN_INFO "Kernel thread qfq-spinner on cpu %d args %p q %p\n", smp_processor_id(), sch, q);
 
-	if (unlikely(err != NET_XMIT_SUCCESS)) {
-		pr_debug("qfq_enqueue: enqueue failed %d\n", err);
-		if (net_xmit_drop_count(err)) {
-			/* FIXME(siva): Class stats should be updated while
-			 * holding the class lock. The QFQ qdisc needs other
-			 * techniques for synchronization.
-			 */
-			cl->qstats.drops++;
-			sch->qstats.drops++;
+	while (!kthread_should_stop()) {
+		/* Wait for a packet to be queued*/
+		if (!q->nr_parked) {
+			t = qfq_phase_start();
+			qfq_spinner_wait_for_skb(sch);
+			qfq_phase_end(q, QFQ_PHASE_WAIT, t);
+		}
+
+		/* V is brought up to date at most once per iteration */
+		now = qfq_now(q);
+
+		if (unlikely(ACCESS_ONCE(q->reset_pending)))
+			qfq_spinner_reset(sch, now);
+
+		/* Perform work items enqueued by CPUs */
+		t = qfq_phase_start();
+		qfq_spinner_activate_classes(sch, now);
+		qfq_phase_end(q, QFQ_PHASE_ACTIVATE, t);
+
+		if (unlikely(ACCESS_ONCE(q->snap_req)))
+			qfq_spinner_snapshot(sch, now);
+
+		if (unlikely(q->nr_parked)) {
+			t = qfq_phase_start();
+			qfq_spinner_retry_parked(sch);
+			qfq_phase_end(q, QFQ_PHASE_RETRY, t);
+		}
+
+		/* Call the real dequeue function */
+		t = qfq_phase_start();
+		skb = NULL;
+		if (q->prio_pending)
+			skb = qfq_prio_dequeue(sch, now);
+		if (!skb)
+			skb = qfq_dequeue(sch, now);
+		qfq_phase_end(q, QFQ_PHASE_DEQUEUE, t);
+		if (skb) {
+			t = qfq_phase_start();
+			qfq_spinner_xmit(sch, skb);
+			qfq_phase_end(q, QFQ_PHASE_XMIT, t);
+			q->spin_busy++;
+		} else
+			q->spin_idle++;
+
+		/* Even when there are packets in the queue, we call the
+		 * scheduler occasionally to avoid RCU stalls.
+		 */
+		schedule_counter++;
+		if (schedule_counter >= 100000) {
+			schedule_counter = 0;
+			schedule();
 		}
-		return err;
 	}
 
-	/* FIXME(siva): bstats are being updated without the class lock. */
-	bstats_update(&cl->bstats, skb);
-	//++sch->q.qlen;
+	printk(KERN_INFO "Kernel thread qfq-spinner stopped on cpu %d\n", smp_processor_id());
+	return 0;
+}
 
-	/* If the new skb is not the head of queue, then done here. */
-	if (cl_qlen != 1)
-		return err;
+/*
+ * The debug files of a qdisc reach it through inode->i_private, which debugfs
+ * keeps handing to files opened before the qdisc was destroyed. So they only
+ * compare it against the qdiscs on qfq_debugfs_list, and use it with
+ * qfq_debugfs_sem held for reading. A qdisc leaves the list with the
+ * semaphore held for writing, before it goes away. Returns NULL, without the
+ * semaphore, if the qdisc is gone.
+ */
+static struct qfq_sched *qfq_debugfs_get(struct Qdisc *sch)
+{
+	struct qfq_sched *q;
 
-	/* If reach this point, queue q was idle */
-	if (cl->inv_w != ONE_FP + 1) {
-		qfq_enqueue_work_entry(q, cl, qdisc_pkt_len(skb));
-		//qfq_activate_class(q, cl, qdisc_pkt_len(skb));
-		//q->wsum_active += ONE_FP / cl->inv_w;
+	down_read(&qfq_debugfs_sem);
+	list_for_each_entry(q, &qfq_debugfs_list, debugfs_node) {
+		if (q == qdisc_priv(sch))
+			return q;
 	}
+	up_read(&qfq_debugfs_sem);
+	return NULL;
+}
 
-	return err;
+static inline void qfq_debugfs_put(void)
+{
+	up_read(&qfq_debugfs_sem);
 }
 
-static int qfq_enqueue_safe(struct sk_buff *skb, struct Qdisc *sch)
+static int qfq_txq_stalls_show(struct seq_file *m, void *v)
 {
-	int rc;
-	spinlock_t *root_lock = qdisc_lock(sch);
+	struct qfq_sched *q = qfq_debugfs_get(m->private);
+	unsigned int i;
 
-	spin_lock(root_lock);
-	rc = qfq_enqueue(skb, sch);
-	spin_unlock(root_lock);
+	if (!q)
+		return -ENODEV;
 
-	return rc;
+	seq_puts(m, "# queue stalls parked\n");
+	for (i = 0; i < q->num_txqs; i++)
+		seq_printf(m, "%u %llu %d\n", i,
+			   (unsigned long long)q->txqs[i].stalls,
+			   q->txqs[i].parked != NULL);
+	qfq_debugfs_put();
+	return 0;
+}
+
+static int qfq_txq_stalls_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, qfq_txq_stalls_show, inode->i_private);
+}
+
+static const struct file_operations qfq_txq_stalls_fops = {
+	.owner		= THIS_MODULE,
+	.open		= qfq_txq_stalls_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/*
+ * Cycles spent in each phase of the spinner loop while profiling was on.
+ * Writing anything clears the counters; the spinner may be updating them at
+ * the same time, so a reset can leave a phase slightly off.
+ */
+static int qfq_phases_show(struct seq_file *m, void *v)
+{
+	struct qfq_sched *q = qfq_debugfs_get(m->private);
+	struct qfq_phase_stats *ps;
+	int i;
+
+	if (!q)
+		return -ENODEV;
+
+	seq_puts(m, "# phase calls cycles max\n");
+	for (i = 0; i < __QFQ_PHASE_MAX; i++) {
+		ps = &q->phases[i];
+		seq_printf(m, "%s %llu %llu %llu\n", qfq_phase_names[i],
+			   (unsigned long long)ps->calls,
+			   (unsigned long long)ps->cycles,
+			   (unsigned long long)ps->max);
+	}
+	qfq_debugfs_put();
+	return 0;
+}
+
+static int qfq_phases_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, qfq_phases_show, inode->i_private);
+}
+
+static ssize_t qfq_phases_write(struct file *file, const char __user *buf,
+				size_t len, loff_t *ppos)
+{
+	struct seq_file *m = file->private_data;
+	struct qfq_sched *q = qfq_debugfs_get(m->private);
+
+	if (!q)
+		return -ENODEV;
+
+	memset(q->phases, 0, sizeof(q->phases));
+	qfq_debugfs_put();
+	return len;
+}
+
+static const struct file_operations qfq_phases_fops = {
+	.owner		= THIS_MODULE,
+	.open		= qfq_phases_open,
+	.read		= seq_read,
+	.write		= qfq_phases_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/*
+ * Ask the spinner for a snapshot and wait for it. A request it has not picked
+ * up within a second is withdrawn; once picked up, it is always completed.
+ */
+static int qfq_snapshot_take(struct qfq_sched *q, struct qfq_snapshot *snap)
+{
+	init_completion(&snap->done);
+	if (cmpxchg(&q->snap_req, NULL, snap))
+		return -EBUSY;
+
+	if (!wait_for_completion_timeout(&snap->done, HZ)) {
+		if (cmpxchg(&q->snap_req, snap, NULL) == snap)
+			return -ETIMEDOUT;
+		wait_for_completion(&snap->done);
+	}
+	return 0;
 }
 
-/*
- * Handle class switch from idle to backlogged.
- */
-static void qfq_activate_class(struct qfq_sched *q, struct qfq_class *cl,
-			       unsigned int pkt_len)
+/* Bitmaps and groups of one tier of a snapshot */
+static void qfq_state_show_tier(struct seq_file *m, const char *tier,
+				unsigned long *bitmaps,
+				struct qfq_snap_group *groups)
 {
-	struct qfq_group *grp = cl->grp;
-	u64 roundedS;
-	int s;
+	struct qfq_snap_group *sg;
+	unsigned int i, j;
 
-	qfq_update_start(q, cl);
+	seq_printf(m, "%sER 0x%lx IR 0x%lx EB 0x%lx IB 0x%lx\n", tier,
+		   bitmaps[ER], bitmaps[IR], bitmaps[EB], bitmaps[IB]);
 
-	/* compute new finish time and rounded start. */
-	cl->F = cl->S + (u64)pkt_len * cl->inv_w;
-	roundedS = qfq_round_down(cl->S, grp->slot_shift);
+	seq_printf(m, "# %sgroup S F front full_slots [slot:classes ...]\n",
+		   tier);
+	for (i = 0; i <= QFQ_MAX_INDEX; i++) {
+		sg = &groups[i];
+		seq_printf(m, "%u %llu %llu %u 0x%lx", i,
+			   (unsigned long long)sg->S,
+			   (unsigned long long)sg->F, sg->front, sg->full_slots);
+		for (j = 0; j < QFQ_MAX_SLOTS; j++)
+			if (sg->slot_len[j])
+				seq_printf(m, " %u:%u", j, sg->slot_len[j]);
+		seq_putc(m, '\n');
+	}
+}
 
-	/*
-	 * insert cl in the correct bucket.
-	 * If cl->S >= grp->S we don't need to adjust the
-	 * bucket list and simply go to the insertion phase.
-	 * Otherwise grp->S is decreasing, we must make room
-	 * in the bucket list, and also recompute the group state.
-	 * Finally, if there were no flows in this group and nobody
-	 * was in ER make sure to adjust V.
-	 */
-	if (grp->full_slots) {
-		if (!qfq_gt(grp->S, cl->S))
-			goto skip_update;
+static int qfq_state_show(struct seq_file *m, void *v)
+{
+	struct qfq_sched *q;
+	struct qfq_snapshot *snap;
+	struct qfq_snap_class *sc;
+	unsigned int i;
+	int err;
 
-		/* create a slot for this cl->S */
-		qfq_slot_rotate(grp, roundedS);
-		/* group was surely ineligible, remove */
-		__clear_bit(grp->index, &q->bitmaps[IR]);
-		__clear_bit(grp->index, &q->bitmaps[IB]);
-	}
-	/*
-	 * For standard QFQ, if the group was empty before (all slots empty) and
-	 * no other classes were [ER] then V would be lagging behind and must
-	 * be updated to make this group eligible immediately. This occurs when
-	 * the link was earlier idle and a new class needs to be activated.
-	 */
+	snap = kzalloc(sizeof(*snap), GFP_KERNEL);
+	if (!snap)
+		return -ENOMEM;
 
-	grp->S = roundedS;
-	grp->F = roundedS + (2ULL << grp->slot_shift);
-	s = qfq_calc_state(q, grp);
-	__set_bit(grp->index, &q->bitmaps[s]);
+	/* The spinner is only stopped once no snapshot is waited for */
+	q = qfq_debugfs_get(m->private);
+	if (!q) {
+		err = -ENODEV;
+		goto out;
+	}
+	err = qfq_snapshot_take(q, snap);
+	qfq_debugfs_put();
+	if (err)
+		goto out;
 
-	pr_debug("qfq enqueue: new state %d %#lx S %lld F %lld V %lld\n",
-		 s, q->bitmaps[s],
-		 (unsigned long long) cl->S,
-		 (unsigned long long) cl->F,
-		 (unsigned long long) q->V);
+	seq_printf(m, "now %llu V %llu\n", (unsigned long long)snap->now,
+		   (unsigned long long)snap->V);
+	seq_printf(m, "wsum %u wsum_active %u qlen %u active %u\n",
+		   snap->wsum, snap->wsum_active, snap->qlen, snap->nr_active);
+	seq_printf(m, "excess V %llu wsum %u wsum_active %u\n",
+		   (unsigned long long)snap->excess_V, snap->xs_wsum,
+		   snap->excess_wsum_active);
+	qfq_state_show_tier(m, "", snap->bitmaps, snap->groups);
+	qfq_state_show_tier(m, "excess ", snap->excess_bitmaps,
+			    snap->excess_groups);
+
+	/* Group x<n> is of the excess tier */
+	seq_puts(m, "# class group backlog qlen S F\n");
+	for (i = 0; i < snap->nr_top; i++) {
+		sc = &snap->top[i];
+		seq_printf(m, "%x:%x %s%u %u %u %llu %llu\n",
+			   TC_H_MAJ(sc->classid) >> 16, TC_H_MIN(sc->classid),
+			   sc->excess ? "x" : "", sc->index, sc->backlog,
+			   sc->qlen,
+			   (unsigned long long)sc->S,
+			   (unsigned long long)sc->F);
+	}
+out:
+	kfree(snap);
+	return err;
+}
 
-skip_update:
-	qfq_slot_insert(q, grp, cl, roundedS);
+static int qfq_state_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, qfq_state_show, inode->i_private);
 }
 
+static const struct file_operations qfq_state_fops = {
+	.owner		= THIS_MODULE,
+	.open		= qfq_state_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
 
-static void qfq_slot_remove(struct qfq_sched *q, struct qfq_group *grp,
-			    struct qfq_class *cl)
+/*
+ * The stats map is read by mapping it; read() is there for tools that would
+ * rather copy it.
+ */
+static ssize_t qfq_map_read(struct file *file, char __user *buf, size_t len,
+			    loff_t *ppos)
 {
-	unsigned int i, offset;
-	u64 roundedS;
+	struct qfq_sched *q = qfq_debugfs_get(file->private_data);
+	ssize_t ret;
 
-	roundedS = qfq_round_down(cl->S, grp->slot_shift);
-	offset = (roundedS - grp->S) >> grp->slot_shift;
-	i = (grp->front + offset) % QFQ_MAX_SLOTS;
+	if (!q)
+		return -ENODEV;
 
-	hlist_del(&cl->next);
-	if (hlist_empty(&grp->slots[i]))
-		__clear_bit(offset, &grp->full_slots);
+	ret = simple_read_from_buffer(buf, len, ppos, q->map, q->map_size);
+	qfq_debugfs_put();
+	return ret;
 }
 
 /*
- * called to forcibly destroy a queue.
- * If the queue is not in the front bucket, or if it has
- * other queues in the front bucket, we can simply remove
- * the queue with no other side effects.
- * Otherwise we must propagate the event up.
+ * The mapping holds references to the pages of the map, so it stays valid
+ * after the qdisc freed it, only no longer updated.
  */
-static void qfq_deactivate_class(struct qfq_sched *q, struct qfq_class *cl)
+static int qfq_map_mmap(struct file *file, struct vm_area_struct *vma)
 {
-	struct qfq_group *grp = cl->grp;
-	unsigned long mask;
-	u64 roundedS;
-	int s;
+	struct qfq_sched *q;
+	int err;
 
-	cl->F = cl->S;
-	qfq_slot_remove(q, grp, cl);
-
-	if (!grp->full_slots) {
-		__clear_bit(grp->index, &q->bitmaps[IR]);
-		__clear_bit(grp->index, &q->bitmaps[EB]);
-		__clear_bit(grp->index, &q->bitmaps[IB]);
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	/* Nor may mprotect() make it writable later */
+	vma->vm_flags &= ~VM_MAYWRITE;
 
-		if (test_bit(grp->index, &q->bitmaps[ER]) &&
-		    !(q->bitmaps[ER] & ~((1UL << grp->index) - 1))) {
-			mask = q->bitmaps[ER] & ((1UL << grp->index) - 1);
-			if (mask)
-				mask = ~((1UL << __fls(mask)) - 1);
-			else
-				mask = ~0UL;
-			qfq_move_groups(q, mask, EB, ER);
-			qfq_move_groups(q, mask, IB, IR);
-		}
-		__clear_bit(grp->index, &q->bitmaps[ER]);
-	} else if (hlist_empty(&grp->slots[grp->front])) {
-		cl = qfq_slot_scan(grp);
-		roundedS = qfq_round_down(cl->S, grp->slot_shift);
-		if (grp->S != roundedS) {
-			__clear_bit(grp->index, &q->bitmaps[ER]);
-			__clear_bit(grp->index, &q->bitmaps[IR]);
-			__clear_bit(grp->index, &q->bitmaps[EB]);
-			__clear_bit(grp->index, &q->bitmaps[IB]);
-			grp->S = roundedS;
-			grp->F = roundedS + (2ULL << grp->slot_shift);
-			s = qfq_calc_state(q, grp);
-			__set_bit(grp->index, &q->bitmaps[s]);
-		}
-	}
+	q = qfq_debugfs_get(file->private_data);
+	if (!q)
+		return -ENODEV;
 
-	qfq_update_eligible(q, q->V);
+	err = remap_vmalloc_range(vma, q->map, vma->vm_pgoff);
+	qfq_debugfs_put();
+	return err;
 }
 
-static void qfq_qlen_notify(struct Qdisc *sch, unsigned long arg)
+static const struct file_operations qfq_map_fops = {
+	.owner		= THIS_MODULE,
+	.open		= simple_open,
+	.read		= qfq_map_read,
+	.mmap		= qfq_map_mmap,
+	.llseek		= default_llseek,
+};
+
+/*
+ * Relay callbacks of the packet log. The log does not overwrite: records
+ * written while all sub-buffers are full are lost and counted.
+ */
+static int qfq_log_subbuf_start(struct rchan_buf *buf, void *subbuf,
+				void *prev_subbuf, size_t prev_padding)
 {
-	struct qfq_sched *q = qdisc_priv(sch);
-	struct qfq_class *cl = (struct qfq_class *)arg;
+	struct qfq_sched *q = buf->chan->private_data;
 
-	if (cl->qdisc->q.qlen == 0)
-		qfq_deactivate_class(q, cl);
+	if (relay_buf_full(buf)) {
+		q->log_lost++;
+		return 0;
+	}
+	return 1;
 }
 
-static unsigned int qfq_drop(struct Qdisc *sch)
+static struct dentry *qfq_log_create_buf_file(const char *filename,
+					      struct dentry *parent,
+					      umode_t mode,
+					      struct rchan_buf *buf,
+					      int *is_global)
 {
-	struct qfq_sched *q = qdisc_priv(sch);
-	struct qfq_group *grp;
-	unsigned int i, j, len;
+	return debugfs_create_file(filename, mode, parent, buf,
+				   &relay_file_operations);
+}
 
-	for (i = 0; i <= QFQ_MAX_INDEX; i++) {
-		grp = &q->groups[i];
-		for (j = 0; j < QFQ_MAX_SLOTS; j++) {
-			struct qfq_class *cl;
+static int qfq_log_remove_buf_file(struct dentry *dentry)
+{
+	debugfs_remove(dentry);
+	return 0;
+}
 
-			hlist_for_each_entry(cl, &grp->slots[j], next) {
+static struct rchan_callbacks qfq_log_callbacks = {
+	.subbuf_start		= qfq_log_subbuf_start,
+	.create_buf_file	= qfq_log_create_buf_file,
+	.remove_buf_file	= qfq_log_remove_buf_file,
+};
 
-				if (!cl->qdisc->ops->drop)
-					continue;
+/* Sub-buffers hold whole records, so the log needs no padding */
+#define QFQ_LOG_SUBBUF_SIZE \
+	rounddown(256 * 1024, sizeof(struct tc_qfq_log_rec))
 
-				len = cl->qdisc->ops->drop(cl->qdisc);
-				if (len > 0) {
-					sch->q.qlen--;
-					if (!cl->qdisc->q.qlen)
-						qfq_deactivate_class(q, cl);
+/* Records lost to full sub-buffers */
+static int qfq_log_lost_show(struct seq_file *m, void *v)
+{
+	struct qfq_sched *q = qfq_debugfs_get(m->private);
 
-					return len;
-				}
-			}
-		}
-	}
+	if (!q)
+		return -ENODEV;
 
+	seq_printf(m, "%llu\n", (unsigned long long)q->log_lost);
+	qfq_debugfs_put();
 	return 0;
 }
 
-static int qfq_dump_qdisc_stats(struct Qdisc *sch, struct gnet_dump *d)
+static int qfq_log_lost_open(struct inode *inode, struct file *file)
 {
-	struct qfq_sched *q = qdisc_priv(sch);
-	struct tc_qfq_xstats xstats = {.type = TCA_QFQ_XSTATS_QDISC};
-
-//	xstats.qdisc_stats.v_forwarded = q->v_forwarded;
-//	xstats.qdisc_stats.idle_on_deq = q->idle_on_deq;
-//	xstats.qdisc_stats.update_grp_on_deq = q->update_grp_on_deq;
-//	xstats.qdisc_stats.txq_blocked = q->txq_blocked;
-	xstats.qdisc_stats.wsum_active = q->wsum_active;
-
-	return gnet_stats_copy_app(d, &xstats, sizeof(xstats));
+	return single_open(file, qfq_log_lost_show, inode->i_private);
 }
 
-/*
- * Wait until a packet is enqueued in the qdisc.
- * We call the kernel schedule() function and check if the kthread should stop
- * only once every few iterations of the queue length checking loop if the
- * qdisc is idle.
- */
-static void qfq_spinner_wait_for_skb(struct Qdisc *sch)
+static const struct file_operations qfq_log_lost_fops = {
+	.owner		= THIS_MODULE,
+	.open		= qfq_log_lost_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+static void qfq_log_open(struct Qdisc *sch)
 {
 	struct qfq_sched *q = qdisc_priv(sch);
-	int schedule_counter = 0;
-	while ((qdisc_qlen(sch) == 0) &&
-	       (schedule_counter || !kthread_should_stop()) &&
-	       (!q->work_bitmap)) {
-		schedule_counter++;
-		if (schedule_counter >= 10000) {
-			schedule_counter = 0;
-			schedule();
-		}
+
+	if (!log_subbufs)
+		return;
+
+	q->log = relay_open("log", q->debugfs_dir, QFQ_LOG_SUBBUF_SIZE,
+			    log_subbufs, &qfq_log_callbacks, q);
+	if (q->log == NULL) {
+		pr_notice("qfq: cannot create the packet log\n");
+		return;
 	}
+
+	debugfs_create_file("log_lost", S_IRUSR, q->debugfs_dir, sch,
+			    &qfq_log_lost_fops);
+	static_key_slow_inc(&qfq_log_key);
 }
 
-static void qfq_spinner_activate_classes(struct Qdisc *sch)
+static void qfq_log_close(struct qfq_sched *q)
 {
-	struct qfq_sched *q = qdisc_priv(sch);
-	unsigned int cpu;
-
-	/* We just check the work bitmap without atomicity to see if there is
-	 * any  work at all. Even if it is incorrect, we would eventually read
-	 * the correct values in another iteration.
-	 */
-	if (!q->work_bitmap)
+	if (q->log == NULL)
 		return;
 
-	qfq_update_system_time(qdisc_priv(sch));
-	for_each_possible_cpu(cpu) {
-		struct qfq_cpu_work_queue *work_queue;
-		struct qfq_cpu_work_entry *ent, *tmp_ent;
+	static_key_slow_dec(&qfq_log_key);
+	relay_close(q->log);
+	q->log = NULL;
+}
 
-		if (!test_and_clear_bit(cpu, &q->work_bitmap))
-			continue;
+/* qfq/profile: write 1 to start the phase profiler of all qdiscs, 0 to stop */
+static int qfq_profile_show(struct seq_file *m, void *v)
+{
+	seq_printf(m, "%d\n", qfq_profile_on);
+	return 0;
+}
 
-		/* Process all class activation requests for the CPU */
-		work_queue = per_cpu_ptr(q->work_queue, cpu);
-		spin_lock(&work_queue->lock);
-		list_for_each_entry_safe(ent, tmp_ent, &work_queue->list, list) {
-			list_del(&ent->list);
-			/* We do not acquire the class lock here since we only activate the
-			 * class and do not update the class qdisc.
-			 */
-			qfq_activate_class(q, ent->cl, ent->pkt_len);
-			q->wsum_active += ONE_FP / ent->cl->inv_w;
-			++sch->q.qlen;
-			kfree(ent);
-		}
-		spin_unlock(&work_queue->lock);
-	}
+static int qfq_profile_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, qfq_profile_show, NULL);
 }
 
-static int qfq_spinner(void *_qdisc)
+static ssize_t qfq_profile_write(struct file *file, const char __user *buf,
+				 size_t len, loff_t *ppos)
 {
-	struct Qdisc *sch = _qdisc;
-	struct qfq_sched *q = qdisc_priv(sch);
-	struct task_struct *tsk = current;
-	struct sched_param param = { .sched_priority = MAX_RT_PRIO - 1 };
-	struct sk_buff *skb = NULL;
-	struct net_device *dev;
-	struct netdev_queue *txq;
-	unsigned int skb_len;
-	int rc;
-	//int new_skb_deq = 0;
-	int schedule_counter = 0;
-	int queue_index;
+	unsigned int on;
+	int err;
 
-	sched_setscheduler(tsk, SCHED_FIFO, &param);
-	printk(KERN_INFO "Kernel thread qfq-spinner on cpu %d args %p q %p\n", smp_processor_id(), sch, q);
+	err = kstrtouint_from_user(buf, len, 0, &on);
+	if (err)
+		return err;
 
-	while (!kthread_should_stop()) {
-		/* Wait for a packet to be queued*/
-		if (!skb)
-			qfq_spinner_wait_for_skb(sch);
+	mutex_lock(&qfq_profile_lock);
+	if (on && !qfq_profile_on)
+		static_key_slow_inc(&qfq_profile_key);
+	else if (!on && qfq_profile_on)
+		static_key_slow_dec(&qfq_profile_key);
+	qfq_profile_on = on;
+	mutex_unlock(&qfq_profile_lock);
 
-		/* Perform work items enqueued by CPUs */
-		qfq_spinner_activate_classes(sch);
+	return len;
+}
+
+static const struct file_operations qfq_profile_fops = {
+	.owner		= THIS_MODULE,
+	.open		= qfq_profile_open,
+	.read		= seq_read,
+	.write		= qfq_profile_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
 
-		if (likely(!skb)) {
-			/* Call the real dequeue function */
-			skb = qfq_dequeue(sch);
+/*
+ * Debug files of a qdisc live in qfq/<dev>-<major>/ under debugfs. Missing
+ * debugfs support is not an error; the files are just not there. A qdisc
+ * replacing one with the same handle is created before the old one is
+ * destroyed, so it gets qfq/<dev>-<major>.<n>/ instead.
+ */
+static void qfq_debugfs_init(struct Qdisc *sch)
+{
+	static atomic_t seq = ATOMIC_INIT(0);
+	struct qfq_sched *q = qdisc_priv(sch);
+	char name[IFNAMSIZ + 20];
+	int len;
 
-			if (unlikely(!skb))
-				goto done;
+	INIT_LIST_HEAD(&q->debugfs_node);
+	if (IS_ERR_OR_NULL(qfq_debugfs_root))
+		return;
 
-			//new_skb_deq = 1;
+	len = snprintf(name, sizeof(name), "%s-%x", qdisc_dev(sch)->name,
+		       TC_H_MAJ(sch->handle) >> 16);
+	q->debugfs_dir = debugfs_create_dir(name, qfq_debugfs_root);
+	if (IS_ERR_OR_NULL(q->debugfs_dir)) {
+		snprintf(name + len, sizeof(name) - len, ".%u",
+			 atomic_inc_return(&seq));
+		q->debugfs_dir = debugfs_create_dir(name, qfq_debugfs_root);
+		if (IS_ERR_OR_NULL(q->debugfs_dir)) {
+			pr_notice("qfq: cannot create debugfs directory %s\n",
+				  name);
+			q->debugfs_dir = NULL;
+			return;
 		}
+		pr_notice("qfq: debugfs directory in use, using %s\n", name);
+	}
 
-		dev = qdisc_dev(sch);
-
-		/* Hash the skb on to one of the available queues */
-		queue_index = skb_tx_hash(dev, skb);
-		skb_set_queue_mapping(skb, queue_index);
-		txq = netdev_get_tx_queue(dev, queue_index);
+	down_write(&qfq_debugfs_sem);
+	list_add(&q->debugfs_node, &qfq_debugfs_list);
+	up_write(&qfq_debugfs_sem);
+
+	debugfs_create_file("txq_stalls", S_IRUSR, q->debugfs_dir, sch,
+			    &qfq_txq_stalls_fops);
+	debugfs_create_file("phases", S_IRUSR | S_IWUSR, q->debugfs_dir, sch,
+			    &qfq_phases_fops);
+	debugfs_create_file("state", S_IRUSR, q->debugfs_dir, sch,
+			    &qfq_state_fops);
+	if (q->map)
+		debugfs_create_file("stats_map", S_IRUSR, q->debugfs_dir, sch,
+				    &qfq_map_fops);
+	qfq_log_open(sch);
+}
 
-		/* The kernel does a lot of stuff which we can quickly
-		 * bypass.  We know the features of our NIC --
-		 * supports hardware checksumming, supports GSO, etc.
-		 * And, only one thread dequeues packets.  So we don't
-		 * need any lock.
-		 */
-		if (!netif_xmit_frozen_or_stopped(txq)) {
-			skb_len = skb->len;
-			rc = dev->netdev_ops->ndo_start_xmit(skb, dev);
-			/* We should trace ndo_start_xmit similar to the way it
-			 * is used in other places, but compiler complains that
-			 * symbol was not found.
-			 */
-			/* trace_net_dev_xmit(skb, rc, dev, skb_len); */
-			if (rc == NETDEV_TX_OK) {
-				txq_trans_update(txq);
-				skb = NULL;
-			} /* else if (new_skb_deq) {
-				new_skb_deq = 0;
-				q->txq_blocked++;
-			} */
-		} /* else if (new_skb_deq) {
-			new_skb_deq = 0;
-			q->txq_blocked++;
-		} */
-done:
+static int qfq_map_alloc(struct qfq_sched *q, unsigned int entries)
+{
+	q->map = NULL;
+	if (!entries)
+		return 0;
 
-		/* Even when there are packets in the queue, we call the
-		 * scheduler occasionally to avoid RCU stalls.
-		 */
-		schedule_counter++;
-		if (schedule_counter >= 100000) {
-			schedule_counter = 0;
-			schedule();
-		}
+	q->map_ids = kcalloc(BITS_TO_LONGS(entries), sizeof(long), GFP_KERNEL);
+	if (q->map_ids == NULL)
+		return -ENOMEM;
+
+	/* vmalloc_user memory is zeroed and can be mapped to user space */
+	q->map_size = PAGE_ALIGN(sizeof(*q->map) +
+				 (size_t)entries *
+				 sizeof(struct tc_qfq_map_entry));
+	q->map = vmalloc_user(q->map_size);
+	if (q->map == NULL) {
+		kfree(q->map_ids);
+		return -ENOMEM;
 	}
 
-	printk(KERN_INFO "Kernel thread qfq-spinner stopped on cpu %d\n", smp_processor_id());
+	q->map->version = TC_QFQ_MAP_VERSION;
+	q->map->entry_size = sizeof(struct tc_qfq_map_entry);
+	q->map->nr_entries = entries;
 	return 0;
 }
 
-static int qfq_init_qdisc(struct Qdisc *sch, struct nlattr *opt)
+static void qfq_map_free(struct qfq_sched *q)
 {
-	struct qfq_sched *q = qdisc_priv(sch);
-	struct qfq_group *grp;
-	int i, j, err;
-	unsigned int cpu;
+	vfree(q->map);
+	kfree(q->map_ids);
+	q->map = NULL;
+}
 
-	err = qdisc_class_hash_init(&q->clhash);
-	if (err < 0)
-		return err;
+static void qfq_init_tier(struct qfq_tier *t)
+{
+	struct qfq_group *grp;
+	int i, j;
 
 	for (i = 0; i <= QFQ_MAX_INDEX; i++) {
-		grp = &q->groups[i];
+		grp = &t->groups[i];
 		grp->index = i;
 		grp->slot_shift = QFQ_MTU_SHIFT + FRAC_BITS
 				   - (QFQ_MAX_INDEX - i);
@@ -1548,16 +4550,74 @@ static int qfq_init_qdisc(struct Qdisc *sch, struct nlattr *opt)
 			INIT_HLIST_HEAD(&grp->slots[j]);
 	}
 
-//	q->v_forwarded = 0;
-//	q->idle_on_deq = 0;
-//	q->update_grp_on_deq = 0;
-//	q->txq_blocked = 0;
-	q->v_diff_sum = 0;
-	q->t_diff_sum = 0;
+	t->v_diff_sum = 0;
+	t->t_diff_sum = 0;
+}
+
+static int qfq_init_qdisc(struct Qdisc *sch, struct nlattr *opt)
+{
+	struct qfq_sched *q = qdisc_priv(sch);
+	int i;
+	unsigned int cpu;
+
+	if (link_speed == 0)
+		return -EINVAL;
+	q->link_speed = link_speed;
+	q->overhead = overhead;
+	if (txq_policy < 0 || txq_policy >= __QFQ_TXQ_MAX)
+		return -EINVAL;
+	q->txq_policy = txq_policy;
+	if (clock_source < 0 || clock_source >= __QFQ_CLOCK_MAX)
+		return -EINVAL;
+	q->clock = clock_source;
+	/* Mbps -> bytes/ns is a factor of 125 / 10^6 */
+	q->drain_rate = div_u64((u64)link_speed * 125 * ONE_FP, 1000000);
+
+	q->cltable = qfq_table_alloc(QFQ_TABLE_MIN_SIZE);
+	if (q->cltable == NULL)
+		return -ENOMEM;
+
+	q->num_txqs = qdisc_dev(sch)->num_tx_queues;
+	q->txqs = kcalloc(q->num_txqs, sizeof(*q->txqs), GFP_KERNEL);
+	if (q->txqs == NULL) {
+		qfq_table_free(q->cltable);
+		return -ENOMEM;
+	}
+
+	q->drop_stats = alloc_percpu(struct qfq_drop_stats);
+	if (q->drop_stats == NULL) {
+		kfree(q->txqs);
+		qfq_table_free(q->cltable);
+		return -ENOMEM;
+	}
+
+	if (qfq_map_alloc(q, stats_map_entries)) {
+		free_percpu(q->drop_stats);
+		kfree(q->txqs);
+		qfq_table_free(q->cltable);
+		return -ENOMEM;
+	}
+
+	qfq_init_tier(&q->guar);
+	qfq_init_tier(&q->excess);
+
+	q->v_forwarded = 0;
+	q->idle_on_deq = 0;
+	q->update_grp_on_deq = 0;
+	q->txq_blocked = 0;
+	q->buffer_delay = buffer_delay_us;
+	q->idle_credit = (u64)idle_credit_us * NSEC_PER_USEC;
+	q->mem_budget = mem_budget;
+	atomic_long_set(&q->backlog, 0);
+	spin_lock_init(&q->drop_lock);
+	q->drop_map = 0;
+	for (i = 0; i < QFQ_DROP_BUCKETS; i++)
+		INIT_LIST_HEAD(&q->drop_buckets[i]);
 
 	/* Allocate and initialize per CPU work queues */
 	q->work_queue = alloc_percpu(struct qfq_cpu_work_queue);
 	q->work_bitmap = 0;
+	q->work_cpus = 0;
 	for_each_possible_cpu(cpu) {
 		struct qfq_cpu_work_queue *work_queue = per_cpu_ptr(q->work_queue, cpu);
 		INIT_LIST_HEAD(&work_queue->list);
@@ -1566,6 +4626,8 @@ static int qfq_init_qdisc(struct Qdisc *sch, struct nlattr *opt)
 
 	sch->flags |= TCQ_F_QFQ_RL;
 
+	qfq_debugfs_init(sch);
+
 	printk(KERN_INFO "Creating spinner args %p q %p\n", sch, q);
 	q->spinner = kthread_create(qfq_spinner, (void *)sch, "qfq-spinner");
 
@@ -1579,30 +4641,24 @@ static int qfq_init_qdisc(struct Qdisc *sch, struct nlattr *opt)
 	return 0;
 }
 
+/*
+ * Purge all classes and drop their pending activations. The tiers, like
+ * sch->q.qlen and the parked packets, belong to the spinner, which empties
+ * them once it sees reset_pending.
+ */
 static void qfq_reset_qdisc(struct Qdisc *sch)
 {
 	struct qfq_sched *q = qdisc_priv(sch);
-	struct qfq_group *grp;
+	struct qfq_class_table *t;
 	struct qfq_class *cl;
-	struct hlist_node *tmp;
-	unsigned int i, j;
+	unsigned int i;
 	unsigned int cpu;
 
-	for (i = 0; i <= QFQ_MAX_INDEX; i++) {
-		grp = &q->groups[i];
-		for (j = 0; j < QFQ_MAX_SLOTS; j++) {
-			hlist_for_each_entry_safe(cl, tmp,
-						  &grp->slots[j], next) {
-				qfq_deactivate_class(q, cl);
-			}
-		}
-	}
-
-	for (i = 0; i < q->clhash.hashsize; i++) {
-		hlist_for_each_entry(cl, &q->clhash.hash[i], common.hnode)
-			qdisc_reset(cl->qdisc);
+	t = qfq_table(q);
+	for (i = 0; i < t->size; i++) {
+		hlist_for_each_entry(cl, &t->buckets[i], hnode[t->node_ver])
+			qfq_purge_queue(q, cl);
 	}
-	sch->q.qlen = 0;
 
 	for_each_possible_cpu(cpu) {
 		struct qfq_cpu_work_queue *work_queue;
@@ -1611,36 +4667,58 @@ static void qfq_reset_qdisc(struct Qdisc *sch)
 		work_queue = per_cpu_ptr(q->work_queue, cpu);
 		spin_lock(&work_queue->lock);
 		list_for_each_entry_safe(ent, tmp_ent, &work_queue->list, list) {
+			/* Parameter changes and removals are still due, and
+			 * removals may be waited for.
+			 */
+			if (ent->type != QFQ_WORK_ACTIVATE)
+				continue;
 			list_del(&ent->list);
+			work_queue->len--;
 			kfree(ent);
 		}
 		spin_unlock(&work_queue->lock);
 	}
-	q->work_bitmap = 0;
+
+	smp_mb();
+	q->reset_pending = 1;
 }
 
 static void qfq_destroy_qdisc(struct Qdisc *sch)
 {
 	struct qfq_sched *q = qdisc_priv(sch);
+	struct qfq_class_table *t;
 	struct qfq_class *cl;
 	struct hlist_node *next;
 	unsigned int i;
 	unsigned int cpu;
 
+	/* Wait for debug file readers, which may be waiting for the spinner */
+	down_write(&qfq_debugfs_sem);
+	list_del_init(&q->debugfs_node);
+	up_write(&qfq_debugfs_sem);
+
 	printk(KERN_INFO "waiting for thread %p to stop\n", q->spinner);
 	if (!IS_ERR(q->spinner)) {
 		kthread_stop(q->spinner);
 	}
 
+	qfq_log_close(q);
+	debugfs_remove_recursive(q->debugfs_dir);
+	for (i = 0; i < q->num_txqs; i++)
+		kfree_skb(q->txqs[i].parked);
+	kfree(q->txqs);
+
 	tcf_destroy_chain(&q->filter_list);
 
-	for (i = 0; i < q->clhash.hashsize; i++) {
-		hlist_for_each_entry_safe(cl, next, &q->clhash.hash[i],
-					  common.hnode) {
+	t = qfq_table(q);
+	for (i = 0; i < t->size; i++) {
+		hlist_for_each_entry_safe(cl, next, &t->buckets[i],
+					  hnode[t->node_ver]) {
 			qfq_destroy_class(sch, cl);
 		}
 	}
-	qdisc_class_hash_destroy(&q->clhash);
+	qfq_table_free(t);
+	q->cltable = NULL;
 
 	/* Free the CPU work queues */
 	for_each_possible_cpu(cpu) {
@@ -1653,11 +4731,15 @@ static void qfq_destroy_qdisc(struct Qdisc *sch)
 			list_del(&ent->list);
 			kfree(ent);
 		}
+		work_queue->len = 0;
 		spin_unlock(&work_queue->lock);
 	}
 	free_percpu(q->work_queue);
 	q->work_queue = NULL;
+	free_percpu(q->drop_stats);
+	qfq_map_free(q);
 	q->work_bitmap = 0;
+	q->work_cpus = 0;
 }
 
 static const struct Qdisc_class_ops qfq_class_ops = {
@@ -1694,12 +4776,33 @@ static struct Qdisc_ops qfq_qdisc_ops __read_mostly = {
 
 static int __init qfq_init(void)
 {
-	return register_qdisc(&qfq_qdisc_ops);
+	int err;
+
+	qfq_class_cachep = KMEM_CACHE(qfq_class, SLAB_HWCACHE_ALIGN);
+	if (!qfq_class_cachep)
+		return -ENOMEM;
+
+	qfq_debugfs_root = debugfs_create_dir("qfq", NULL);
+	if (!IS_ERR_OR_NULL(qfq_debugfs_root))
+		debugfs_create_file("profile", S_IRUSR | S_IWUSR,
+				    qfq_debugfs_root, NULL, &qfq_profile_fops);
+
+	err = register_qdisc(&qfq_qdisc_ops);
+	if (err) {
+		debugfs_remove_recursive(qfq_debugfs_root);
+		kmem_cache_destroy(qfq_class_cachep);
+	}
+	return err;
 }
 
 static void __exit qfq_exit(void)
 {
 	unregister_qdisc(&qfq_qdisc_ops);
+	debugfs_remove_recursive(qfq_debugfs_root);
+	if (qfq_profile_on)
+		static_key_slow_dec(&qfq_profile_key);
+	rcu_barrier_bh(); /* Wait for qfq_free_class_rcu */
+	kmem_cache_destroy(qfq_class_cachep);
 }
 
 module_init(qfq_init);